@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "serial.h"
+#include "verify.h"
+
+// The cache is a header followed by a body holding the global names, the
+// selector names and the script function. The header records the hash of
+// the source and of the body, so a stale or damaged cache is never parsed.
+// Functions are written where their prototype appears among the constants of
+// the enclosing function.
+#define CACHE_MAGIC 0x434f584c // "LOXC"
+
+typedef enum {
+  CONST_NIL,
+  CONST_FALSE,
+  CONST_TRUE,
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+} const_tag;
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t registers; // whether the code has register instructions
+  uint64_t src_len;
+  uint64_t src_hash;
+  uint64_t body_len;
+  uint64_t body_hash;
+} Header;
+
+char *cache_path(const char *path)
+{
+  size_t len = strlen(path);
+  char *cache = malloc(len + 2);
+  if (cache == NULL) {
+    return NULL;
+  }
+  memcpy(cache, path, len);
+  cache[len] = 'c';
+  cache[len + 1] = '\0';
+  return cache;
+}
+
+static void put_tag(Writer *w, const_tag tag) { put_u8(w, tag); }
+
+static void put_function(Writer *w, ObjectFunction *fun);
+
+static void put_constant(Writer *w, Value value)
+{
+  if (is_nil(value)) {
+    put_tag(w, CONST_NIL);
+  } else if (is_bool(value)) {
+    put_tag(w, as_bool(value) ? CONST_TRUE : CONST_FALSE);
+  } else if (is_number(value)) {
+    put_tag(w, CONST_NUMBER);
+    put_f64(w, as_number(value));
+  } else if (is_string(value)) {
+    put_tag(w, CONST_STRING);
+    put_string(w, as_string(value));
+  } else {
+    put_tag(w, CONST_FUNCTION);
+    put_function(w, as_function(value));
+  }
+}
+
+static void put_function(Writer *w, ObjectFunction *fun)
+{
+  put_string(w, fun->name);
+  put_u32(w, fun->arity);
+  put_u32(w, fun->upvalue_size);
+  put_u32(w, fun->slot_size);
+  put_u32(w, fun->ic_size);
+
+  put_chunk(w, &fun->chunk);
+  put_u32(w, fun->constants.len);
+  for (int i = 0; i < fun->constants.len; i++) {
+    put_constant(w, fun->constants.value[i]);
+  }
+}
+
+int cache_write(const char *path, const char *src, ObjectFunction *script,
+                Globals *globals)
+{
+  Writer w;
+  writer_init(&w);
+  put_slots(&w, globals);
+  put_function(&w, script);
+
+  size_t src_len = strlen(src);
+  Header header = {
+    .magic = CACHE_MAGIC,
+    .version = CACHE_VERSION,
+    .registers = compile_registers,
+    .src_len = src_len,
+    .src_hash = hash64(src, src_len),
+    .body_len = w.len,
+    .body_hash = hash64(w.buf, w.len),
+  };
+
+  int err = write_file(path, &header, sizeof(header), &w);
+  writer_free(&w);
+  return err;
+}
+
+static bool get_function(Reader *r, ValueArray *funs, ObjectFunction *fun);
+
+static bool get_constant(Reader *r, ValueArray *funs, Value *value)
+{
+  uint8_t tag = get_u8(r);
+  if (r->bad) {
+    return false;
+  }
+  switch (tag) {
+  case CONST_NIL:
+    *value = value_make_nil();
+    return true;
+  case CONST_FALSE:
+  case CONST_TRUE:
+    *value = value_make_bool(tag == CONST_TRUE);
+    return true;
+  case CONST_NUMBER: {
+    double number = get_f64(r);
+    *value = value_make_number(number);
+    return !r->bad;
+  }
+  case CONST_STRING: {
+    ObjectString *str = get_string(r);
+    if (str == NULL) {
+      return false;
+    }
+    *value = value_make_object((Object *)str);
+    return true;
+  }
+  case CONST_FUNCTION: {
+    ObjectFunction *fun = (ObjectFunction *)fun_new(0, NULL);
+    *value = value_make_object((Object *)fun);
+    value_array_write(funs, *value);
+    return get_function(r, funs, fun);
+  }
+  default:
+    return false;
+  }
+}
+
+// get_function reads a function into fun, whose chunk and constants are
+// empty, adding the functions among its constants to funs.
+static bool get_function(Reader *r, ValueArray *funs, ObjectFunction *fun)
+{
+  fun->name = get_string(r);
+  uint32_t arity = get_u32(r);
+  uint32_t upvalue_size = get_u32(r);
+  uint32_t slot_size = get_u32(r);
+  uint32_t ic_size = get_u32(r);
+  if (r->bad || fun->name == NULL || arity > UINT8_MAX
+      || upvalue_size > UINT8_MAX + 1 || slot_size > UINT8_MAX + 1
+      || ic_size > UINT16_MAX + 1) {
+    return false;
+  }
+  fun->arity = arity;
+  fun->upvalue_size = upvalue_size;
+  fun->slot_size = slot_size;
+  fun_init_ics(fun, ic_size);
+
+  if (!get_chunk(r, &fun->chunk)) {
+    return false;
+  }
+
+  uint32_t const_len = get_u32(r);
+  if (r->bad || const_len > UINT16_MAX + 1) {
+    return false;
+  }
+  for (uint32_t i = 0; i < const_len; i++) {
+    Value value;
+    if (!get_constant(r, funs, &value)) {
+      return false;
+    }
+    value_array_write(&fun->constants, value);
+  }
+  return true;
+}
+
+// load reads the cache in r for src into script, and the other functions
+// into funs.
+static bool load(Reader *r, const char *src, ObjectFunction *script,
+                 ValueArray *funs, Globals *globals)
+{
+  Header header;
+  const uint8_t *bytes = get_bytes(r, sizeof(header));
+  if (bytes == NULL) {
+    return false;
+  }
+  memcpy(&header, bytes, sizeof(header));
+  size_t src_len = strlen(src);
+  if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION
+      || header.registers != compile_registers
+      || header.src_len != src_len
+      || header.body_len != (uint64_t)(r->end - r->pos)
+      || header.src_hash != hash64(src, src_len)
+      || header.body_hash != hash64(r->pos, header.body_len)) {
+    return false;
+  }
+
+  if (!get_slots(r, globals)) {
+    return false;
+  }
+  if (r->bad || !get_function(r, funs, script) || r->pos != r->end) {
+    return false;
+  }
+
+  if (verify(script, globals)) {
+    return false;
+  }
+  for (int i = 0; i < funs->len; i++) {
+    ObjectFunction *fun = as_function(funs->value[i]);
+    if (verify(fun, globals)) {
+      return false;
+    }
+    fun->verified = true;
+  }
+  return true;
+}
+
+int cache_load(const char *path, const char *src, ObjectFunction *script,
+               ValueArray *functions, Globals *globals)
+{
+  Reader r;
+  if (map_file(path, &r)) {
+    return 1;
+  }
+
+  ObjectString *name = script->name;
+  ValueArray funs;
+  value_array_init(&funs);
+  bool ok = load(&r, src, script, &funs, globals);
+  unmap_file(&r);
+
+  if (ok) {
+    for (int i = 0; i < funs.len; i++) {
+      value_array_write(functions, funs.value[i]);
+    }
+  } else {
+    // The functions read so far are left to the collector.
+    chunk_free(&script->chunk);
+    value_array_free(&script->constants);
+    fun_init_ics(script, 0);
+    script->name = name;
+    script->arity = 0;
+    script->upvalue_size = 0;
+    script->slot_size = 0;
+  }
+  value_array_free(&funs);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,35 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "globals.h"
+#include "object.h"
+#include "value.h"
+
+// A bytecode cache holds the compiled function tree of a script: every
+// chunk with its line table, constants and upvalue counts, along with the
+// global and method names the code refers to by slot. It is written next to
+// the script, with a "c" appended to its path. It records a hash of the
+// source so a stale cache is never used, and is only used in the mode, stack
+// or register, its code was compiled in.
+//
+// Bump CACHE_VERSION whenever the bytecode or the layout of the cache
+// changes.
+#define CACHE_VERSION 2
+
+// cache_path returns the path of the cache of the script at path. The caller
+// frees it.
+char *cache_path(const char *path);
+
+// cache_load loads the cache at path into script if it was written for src,
+// adding the other functions to functions and the names to globals and the
+// method selectors. The code is verified before it is used. It returns 0 on
+// success, and 1 if there is no valid cache, leaving script untouched.
+int cache_load(const char *path, const char *src, ObjectFunction *script,
+               ValueArray *functions, Globals *globals);
+
+// cache_write writes the cache of script compiled from src to path. It
+// returns 0 on success.
+int cache_write(const char *path, const char *src, ObjectFunction *script,
+                Globals *globals);
+
+#endif
@@ -8,6 +8,8 @@ void chunk_init(Chunk *chunk)
   chunk->len = 0;
   chunk->cap = 0;
   chunk->code = NULL;
+  chunk->line_len = 0;
+  chunk->line_cap = 0;
   chunk->lines = NULL;
 }
 
@@ -17,10 +19,17 @@ void chunk_add(Chunk *chunk, uint8_t byte, int line)
     int oldSize = chunk->cap;
     chunk->cap = grow_cap(chunk->cap);
     chunk->code = grow_array(uint8_t, chunk->code, oldSize, chunk->cap);
-    chunk->lines = grow_array(int, chunk->lines, oldSize, chunk->cap);
+  }
+  if (chunk->line_len == 0 || chunk->lines[chunk->line_len - 1].line != line) {
+    if (chunk->line_cap < chunk->line_len + 1) {
+      int old_cap = chunk->line_cap;
+      chunk->line_cap = grow_cap(chunk->line_cap);
+      chunk->lines
+          = grow_array(LineRun, chunk->lines, old_cap, chunk->line_cap);
+    }
+    chunk->lines[chunk->line_len++] = (LineRun){ chunk->len, line };
   }
   chunk->code[chunk->len] = byte;
-  chunk->lines[chunk->len] = line;
   chunk->len++;
 }
 
@@ -33,7 +42,25 @@ void chunk_set(Chunk *chunk, int offset, uint8_t byte)
 void chunk_free(Chunk *chunk)
 {
   free_array(uint8_t, chunk->code, chunk->cap);
+  free_array(LineRun, chunk->lines, chunk->line_cap);
   chunk_init(chunk);
 }
 
 int chunk_len(Chunk *chunk) { return chunk->len; }
+
+int chunk_line(Chunk *chunk, int offset)
+{
+  assert(chunk->line_len > 0 && offset < chunk->len);
+  // find the last run starting at or before offset
+  int lo = 0;
+  int hi = chunk->line_len - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return chunk->lines[lo].line;
+}
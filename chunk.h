@@ -9,6 +9,7 @@ typedef enum {
   OP_NONE,
   OP_RETURN,
   OP_CONSTANT,
+  OP_CONSTANT_LONG, // CONSTANT with a 16-bit index
   OP_NEGATIVE,
   OP_NOT,
   OP_MINUS,
@@ -46,13 +47,70 @@ typedef enum {
   OP_INVOKE,
   OP_DERIVE,
   OP_GET_SUPER,
+  OP_END_CLASS, // seal the class and pop it
+
+  // Superinstructions, only emitted by the peephole pass
+  OP_GET_LOCAL_GET_FIELD, // GET_LOCAL; GET_FIELD
+  OP_ADD_CONST,           // CONSTANT; ADD
+  OP_SET_LOCAL_POP,       // SET_LOCAL; POP
+  // <compare>; JMP_ON_FALSE; POP, where the jump lands on another POP
+  OP_JMP_UNLESS_EQUAL,
+  OP_JMP_UNLESS_GREATER,
+  OP_JMP_UNLESS_GREATER_EQUAL,
+  OP_JMP_UNLESS_LESS,
+  OP_JMP_UNLESS_LESS_EQUAL,
+
+  // Register instructions, emitted by the peephole pass in register mode.
+  // They take their operands straight from local slots (L) and constants
+  // (C) by index. The arithmetic ones push their result, or store it in
+  // local slot dst in the _TO form. Each operator has its four forms in
+  // this order, so that the pass can pick one by offset.
+  OP_ADD_LL,    // a b: GET_LOCAL a; GET_LOCAL b; ADD
+  OP_ADD_LC,    // a c: GET_LOCAL a; CONSTANT c; ADD
+  OP_ADD_LL_TO, // dst a b: ADD_LL a b; SET_LOCAL dst; POP
+  OP_ADD_LC_TO, // dst a c: ADD_LC a c; SET_LOCAL dst; POP
+  OP_MINUS_LL,
+  OP_MINUS_LC,
+  OP_MINUS_LL_TO,
+  OP_MINUS_LC_TO,
+  OP_MUL_LL,
+  OP_MUL_LC,
+  OP_MUL_LL_TO,
+  OP_MUL_LC_TO,
+  OP_DIV_LL,
+  OP_DIV_LC,
+  OP_DIV_LL_TO,
+  OP_DIV_LC_TO,
+  // a b dist16 and a c dist16: the JMP_UNLESS_<compare> above on a local
+  // and a local or a constant
+  OP_JMP_UNLESS_EQUAL_LL,
+  OP_JMP_UNLESS_EQUAL_LC,
+  OP_JMP_UNLESS_GREATER_LL,
+  OP_JMP_UNLESS_GREATER_LC,
+  OP_JMP_UNLESS_GREATER_EQUAL_LL,
+  OP_JMP_UNLESS_GREATER_EQUAL_LC,
+  OP_JMP_UNLESS_LESS_LL,
+  OP_JMP_UNLESS_LESS_LC,
+  OP_JMP_UNLESS_LESS_EQUAL_LL,
+  OP_JMP_UNLESS_LESS_EQUAL_LC,
+  OP_MOVE,       // dst a: GET_LOCAL a; SET_LOCAL dst; POP
+  OP_LOAD_CONST, // dst c: CONSTANT c; SET_LOCAL dst; POP
 } op_code;
 
+// LineRun starts a run of bytes of the same source line at offset.
+typedef struct {
+  int offset;
+  int line;
+} LineRun;
+
 typedef struct {
   int len;
   int cap;
-  int *lines;
   uint8_t *code;
+  // lines holds a run for each change of line along the code, by offset
+  int line_len;
+  int line_cap;
+  LineRun *lines;
 } Chunk;
 
 void chunk_init(Chunk *chunk);
@@ -61,4 +119,7 @@ void chunk_set(Chunk *chunk, int offset, uint8_t byte);
 void chunk_free(Chunk *chunk);
 int chunk_len(Chunk *chunk);
 
+// chunk_line returns the source line of the byte at offset.
+int chunk_line(Chunk *chunk, int offset);
+
 #endif
@@ -8,7 +8,16 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "peephole.h"
 #include "value.h"
+#include "verify.h"
+
+#ifdef STACK_VM
+bool compile_registers = false;
+#else
+bool compile_registers = true;
+#endif
 
 static void error_at(Compiler *c, Token tk, char *msg)
 {
@@ -82,59 +91,119 @@ static void emit_bytes(Compiler *c, uint8_t b1, uint8_t b2)
   emit_byte(c, b2);
 }
 
-static int add_constant(Compiler *c, Value value)
+// make_string returns the string object for an identifier or string
+// literal. Strings already seen by this compiler are found by hashing the
+// source text, so no object is allocated for them.
+static Value make_string(Compiler *c, const char *src, int len)
 {
-  value_array_write(c->constants, value);
-  return c->constants->len - 1;
+  uint32_t hash = FNV1a_hash(src, len);
+  Object *interned = map_find_string(&c->interned_strings, src, len, hash);
+  if (interned != NULL) {
+    return value_make_object(interned);
+  }
+
+  Value ret = value_make_object(string_copy((char *)src, len));
+  map_put(&c->interned_strings, ret, value_make_nil());
+  return ret;
 }
 
-static Value make_string(Compiler *c, const char *src, int len)
+// same_constant returns whether a and b may share a slot of the constant
+// pool. Numbers must have the same bits, so 0 and -0 are kept apart.
+static bool same_constant(Value a, Value b)
 {
-  Value ret = value_make_nil();
+  if (is_number(a) || is_number(b)) {
+    if (!is_number(a) || !is_number(b)) {
+      return false;
+    }
+    double x = as_number(a);
+    double y = as_number(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return value_equal(a, b);
+}
 
-  MapIter *iter = map_iter_new(&c->interned_strings);
-  while (map_iter_next(iter)) {
-    if (len != as_string(iter->key)->len) {
-      continue;
+// const_bucket returns the bucket of the table holding value, or the empty
+// one where it belongs.
+static int *const_bucket(ConstTable *table, ValueArray *pool, Value value)
+{
+  uint32_t mask = table->cap - 1;
+  for (uint32_t i = value_hash(value) & mask;; i = (i + 1) & mask) {
+    int *bucket = &table->buckets[i];
+    if (*bucket == 0 || same_constant(pool->value[*bucket - 1], value)) {
+      return bucket;
     }
-    if (strncmp(src, as_string(iter->key)->str, len) == 0) {
-      ret = iter->key;
-      break;
+  }
+}
+
+static void const_grow(ConstTable *table, ValueArray *pool)
+{
+  int old_cap = table->cap;
+  int *old = table->buckets;
+  table->cap = old_cap == 0 ? 16 : old_cap * 2;
+  table->buckets = grow_array(int, NULL, 0, table->cap);
+  memset(table->buckets, 0, sizeof(int) * table->cap);
+  for (int i = 0; i < old_cap; i++) {
+    if (old[i] != 0) {
+      *const_bucket(table, pool, pool->value[old[i] - 1]) = old[i];
     }
   }
-  map_iter_close(iter);
+  free_array(int, old, old_cap);
+}
 
-  if (is_nil(ret)) {
-    ret = value_make_object(string_copy(src, len));
-    map_put(&c->interned_strings, ret, value_make_nil());
+// const_index enters constant idx of the pool into the table.
+static void const_index(ConstTable *table, ValueArray *pool, int idx)
+{
+  if ((table->len + 1) * 4 > table->cap * 3) {
+    const_grow(table, pool);
   }
+  *const_bucket(table, pool, pool->value[idx]) = idx + 1;
+  table->len++;
+}
 
-  return ret;
+static void const_free(ConstTable *table)
+{
+  free_array(int, table->buckets, table->cap);
 }
 
-// make_constant returns the idx of constant value. If the value has been
-// created, return its idx. Else, add new constant to compiling chunk.
-static uint8_t make_constant(Compiler *c, Value value)
+// make_constant returns the index of value in the constant pool of the
+// function being compiled, adding it if it is not there yet.
+static int make_constant(Compiler *c, Value value)
 {
-#define value_as_int(value) ((int)as_number(value))
-  Value vidx;
-  if (map_get(&c->mconstants, value, &vidx)) {
-    return (uint8_t)value_as_int(vidx);
+  ObjectFunction *fun = c->cur_scope->fun;
+  ConstTable *table = &c->cur_scope->constants;
+  if (table->cap > 0) {
+    int *bucket = const_bucket(table, &fun->constants, value);
+    if (*bucket != 0) {
+      return *bucket - 1;
+    }
   }
-  int constant = add_constant(c, value);
-  if (constant > UINT8_MAX) {
-    // FIXME: add error
+  if (fun->constants.len > UINT16_MAX) {
+    errorf(c, "Too many constants in one chunk.");
     return 0;
   }
-  vidx = value_make_number((double)constant);
-  map_put(&c->mconstants, value, vidx);
-#undef value_as_int
-  return (uint8_t)constant;
+  value_array_write(&fun->constants, value);
+  // the script function of the repl may be old already
+  write_barrier((Object *)fun, value);
+  const_index(table, &fun->constants, fun->constants.len - 1);
+  return fun->constants.len - 1;
+}
+
+// emit_constant_op emits op on the 16-bit index of constant value.
+static void emit_constant_op(Compiler *c, uint8_t op, Value value)
+{
+  int constant = make_constant(c, value);
+  emit_byte(c, op);
+  emit_bytes(c, (constant >> 8) & 0xff, constant & 0xff);
 }
 
 static void emit_constant(Compiler *c, Value value)
 {
-  emit_bytes(c, OP_CONSTANT, make_constant(c, value));
+  int constant = make_constant(c, value);
+  if (constant <= UINT8_MAX) {
+    emit_bytes(c, OP_CONSTANT, constant);
+  } else {
+    emit_constant_op(c, OP_CONSTANT_LONG, value);
+  }
 }
 
 static int emit_jmp(Compiler *c, uint8_t jmpop)
@@ -153,16 +222,41 @@ static void patch_jmp(Compiler *c, int jmp_pos, int target_pos)
   } else {
     offset = jmp_pos + 3 - target_pos;
   }
+  if (offset > UINT16_MAX) {
+    errorf(c, target_pos >= jmp_pos ? "Too much code to jump over."
+                                    : "Loop body too large.");
+    return;
+  }
   chunk_set(c->cur_chunk, jmp_pos + 1, (offset >> 8) & 0xff);
   chunk_set(c->cur_chunk, jmp_pos + 2, (offset)&0xff);
 }
 
 static void emit_return(Compiler *c) { emit_byte(c, OP_RETURN); }
 
-static void scope_init(Scope *scope)
+// emit_ic reserves an inline cache for the property access just emitted and
+// writes its 16-bit index as the operand.
+static void emit_ic(Compiler *c)
 {
+  Scope *scope = c->cur_scope;
+  if (scope->ic_size > UINT16_MAX) {
+    errorf(c, "Too many property accesses in one function.");
+    return;
+  }
+  int idx = scope->ic_size++;
+  emit_bytes(c, (idx >> 8) & 0xff, idx & 0xff);
+}
+
+static void scope_init(Scope *scope, ObjectFunction *fun)
+{
+  scope->fun = fun;
+  scope->constants.len = 0;
+  scope->constants.cap = 0;
+  scope->constants.buckets = NULL;
   scope->sp = -1;
+  scope->slot_size = 0;
   scope->cur_depth = 0;
+  scope->upvalue_size = 0;
+  scope->ic_size = 0;
   scope->enclosing = NULL;
 }
 
@@ -218,12 +312,19 @@ static int find_local(Scope *scope, Value name, int method)
   }
 }
 
-static void scope_add(Scope *scope, Value name)
+static void scope_add(Compiler *c, Scope *scope, Value name)
 {
+  if (scope->sp == UINT8_MAX) {
+    errorf(c, "Too many local variables in function.");
+    return;
+  }
   scope->sp++;
   scope->locals[scope->sp].depth = scope->cur_depth;
   scope->locals[scope->sp].name = name;
   scope->locals[scope->sp].is_captured = false;
+  if (scope->sp + 1 > scope->slot_size) {
+    scope->slot_size = scope->sp + 1;
+  }
 }
 
 static void scope_debug(Scope *scope)
@@ -303,13 +404,36 @@ static inline bool is_global(Scope *scope)
   return scope->enclosing == NULL && scope->cur_depth == 0;
 }
 
+// emit_global emits op on the slot of the global variable name.
+static void emit_global(Compiler *c, uint8_t op, Value name)
+{
+  int slot = globals_slot(c->globals, name);
+  if (slot >= GLOBALS_MAX) {
+    errorf(c, "Too many global variables.");
+    return;
+  }
+  emit_byte(c, op);
+  emit_bytes(c, (slot >> 8) & 0xff, slot & 0xff);
+}
+
+// emit_selector emits op on the selector of the method name.
+static void emit_selector(Compiler *c, uint8_t op, Value name)
+{
+  int selector = selector_of(as_string(name));
+  if (selector >= SELECTOR_MAX) {
+    errorf(c, "Too many method names.");
+    return;
+  }
+  emit_byte(c, op);
+  emit_bytes(c, (selector >> 8) & 0xff, selector & 0xff);
+}
+
 static void defvar(Compiler *c, Value name)
 {
   if (is_global(c->cur_scope)) {
-    uint8_t constant = make_constant(c, name);
-    emit_bytes(c, OP_GLOBAL, constant);
+    emit_global(c, OP_GLOBAL, name);
   } else {
-    scope_add(c->cur_scope, name);
+    scope_add(c, c->cur_scope, name);
   }
 }
 
@@ -330,9 +454,7 @@ static void setvar(Compiler *c, Value name)
     return;
   }
 
-  // find in globals
-  uint8_t constant = make_constant(c, name);
-  emit_bytes(c, OP_SET_GLOBAL, constant);
+  emit_global(c, OP_SET_GLOBAL, name);
 }
 
 static void getvar(Compiler *c, Value name)
@@ -351,9 +473,7 @@ static void getvar(Compiler *c, Value name)
     return;
   }
 
-  // find in globals
-  uint8_t constant = make_constant(c, name);
-  emit_bytes(c, OP_GET_GLOBAL, constant);
+  emit_global(c, OP_GET_GLOBAL, name);
 }
 
 // Pratt parsing algorithm
@@ -414,7 +534,8 @@ static void eval(Compiler *c, Context context)
   if (context.id == TK_IDENT) {
     getvar(c, context.first);
   } else if (context.id == TK_DOT) {
-    emit_bytes(c, OP_GET_FIELD, make_constant(c, context.first));
+    emit_constant_op(c, OP_GET_FIELD, context.first);
+    emit_ic(c);
   } else {
     emit_constant(c, context.first);
   }
@@ -479,6 +600,9 @@ static Context literal(Compiler *c)
   case TK_STRING:
     v = make_string(c, token_lexem_start(&tk) + 1, token_lexem_len(&tk) - 2);
     break;
+  default:
+    v = value_make_nil();
+    break;
   }
   return unary_context(tk.type, v);
 }
@@ -517,7 +641,7 @@ static Context _super(Compiler *c)
 
   getvar(c, make_string(c, "this", 4));
   getvar(c, make_string(c, "super", 5));
-  emit_bytes(c, OP_GET_SUPER, make_constant(c, name));
+  emit_selector(c, OP_GET_SUPER, name);
 
   return empty_context(TK_SUPER);
 }
@@ -589,7 +713,8 @@ static Context assignment(Compiler *c, Context left)
   if (left.id == TK_IDENT) {
     setvar(c, left.first);
   } else {
-    emit_bytes(c, OP_SET_FIELD, make_constant(c, left.first));
+    emit_constant_op(c, OP_SET_FIELD, left.first);
+    emit_ic(c);
   }
   return empty_context(tk.type);
 }
@@ -637,8 +762,13 @@ static Context dot(Compiler *c, Context left)
 
   if (match(c, TK_LEFT_PAREN)) {
     int arity = arguments(c);
-    emit_byte(c, OP_INVOKE);
-    emit_bytes(c, arity, make_constant(c, field));
+    emit_bytes(c, OP_INVOKE, arity);
+    int selector = selector_of(as_string(field));
+    if (selector >= SELECTOR_MAX) {
+      errorf(c, "Too many method names.");
+    }
+    emit_bytes(c, (selector >> 8) & 0xff, selector & 0xff);
+    emit_ic(c);
     return empty_context(TK_DOT);
   }
 
@@ -907,8 +1037,12 @@ static void function(Compiler *c, Value fname, bool is_method)
 {
   consume(c, TK_LEFT_PAREN, "Expect '(' after function name.");
 
+  Value fun = value_make_fun(0, as_string(fname));
+  ObjectFunction *funobj = as_function(fun);
+  value_array_write(c->functions, fun);
+
   Scope scope;
-  scope_init(&scope);
+  scope_init(&scope, funobj);
   frame_enter(c, &scope);
 
   if (is_method) {
@@ -917,15 +1051,12 @@ static void function(Compiler *c, Value fname, bool is_method)
     defvar(c, fname);
   }
 
-  int arity = parameters(c);
-
-  Value fun = value_make_fun(arity, as_string(fname));
+  funobj->arity = parameters(c);
 
   consume(c, TK_LEFT_BRACE, "Expect '{' before function body.");
 
   // switch compiling chunk
   Chunk *enclosing = c->cur_chunk;
-  ObjectFunction *funobj = (ObjectFunction *)as_object(fun);
   c->cur_chunk = &funobj->chunk;
 
   block_stmt(c);
@@ -937,23 +1068,30 @@ static void function(Compiler *c, Value fname, bool is_method)
   }
   emit_byte(c, OP_RETURN);
 
+  if (!c->error) {
+    peephole(funobj, compile_registers);
+  }
+
 #ifdef DEBUG
-  debug_chunk(c->cur_chunk, c->constants, as_string(fname)->str);
+  debug_chunk(c->cur_chunk, &funobj->constants, as_string(fname)->str);
 #endif
 
   funobj->upvalue_size = scope.upvalue_size;
+  funobj->slot_size = scope.slot_size;
+  fun_init_ics(funobj, scope.ic_size);
+  const_free(&scope.constants);
   frame_out(c);
 
   // back to previous compiling chunk
   c->cur_chunk = enclosing;
-  emit_bytes(c, OP_CLOSURE, make_constant(c, fun));
+  emit_constant_op(c, OP_CLOSURE, fun);
   for (int i = 0; i < scope.upvalue_size; i++) {
     emit_byte(c, (uint8_t)scope.upvalues[i].idx);
     emit_byte(c, scope.upvalues[i].from_local ? 1 : 0);
   }
 
   if (is_method) {
-    emit_bytes(c, OP_METHOD, make_constant(c, fname));
+    emit_selector(c, OP_METHOD, fname);
   } else {
     defvar(c, fname);
   }
@@ -1000,7 +1138,7 @@ static void class_declaration(Compiler *c)
   consume(c, TK_IDENT, "Expect class name.");
   Value name = variable(c).first;
 
-  emit_bytes(c, OP_CLASS, make_constant(c, name));
+  emit_constant_op(c, OP_CLASS, name);
   defvar(c, name);
 
   scope_in(c->cur_scope);
@@ -1031,6 +1169,7 @@ static void class_declaration(Compiler *c)
     method(c);
   }
   consume(c, TK_RIGHT_BRACE, "Expect '}' after class body.");
+  emit_byte(c, OP_END_CLASS);
 
   scope_out(c->cur_scope, c);
 
@@ -1131,27 +1270,36 @@ static void compiler_init(Compiler *c, char *src)
 
   c->panic = 0;
   c->error = 0;
+  c->in_class = false;
+  c->has_super = false;
+  c->in_initializer = false;
 
   lex_init(&c->lexer, src, strlen(src));
 
   map_init(&c->interned_strings);
-  map_init(&c->mconstants);
 
   // initial forward
   forward(c);
 }
 
-static int compile_chunk(char *src, Chunk *chunk, ValueArray *constants)
+static int compile_chunk(char *src, ObjectFunction *fun, ValueArray *functions,
+                         Globals *globals)
 {
   Compiler c;
   compiler_init(&c, src);
-  c.cur_chunk = chunk;
-  c.constants = constants;
-  make_constant(&c, make_string(&c, "init", 4));
+  c.cur_chunk = &fun->chunk;
+  c.functions = functions;
+  c.globals = globals;
 
   Scope root;
-  scope_init(&root);
-  scope_add(&root, make_string(&c, "script", 6));
+  scope_init(&root, fun);
+  // the script of the repl keeps the constants of the earlier lines
+  for (int i = 0; i < fun->constants.len; i++) {
+    const_index(&root.constants, &fun->constants, i);
+  }
+  scope_add(&c, &root, make_string(&c, "script", 6));
+  // keep numbering after the caches of code compiled earlier in the repl
+  root.ic_size = fun->ic_size;
   c.cur_scope = &root;
 
   while (!match(&c, TK_EOF)) {
@@ -1164,24 +1312,61 @@ static int compile_chunk(char *src, Chunk *chunk, ValueArray *constants)
   emit_constant(&c, value_make_nil());
   emit_byte(&c, OP_RETURN);
 
+  // code compiled earlier in the repl stays in the chunk and still addresses
+  // its own slots
+  if (root.slot_size > fun->slot_size) {
+    fun->slot_size = root.slot_size;
+  }
+  fun_init_ics(fun, root.ic_size);
+  const_free(&root.constants);
+
+  if (!c.error) {
+    peephole(fun, compile_registers);
+  }
+
   return c.error;
 }
 
-int compile(char *src, ObjectFunction *fun, ValueArray *constants)
+// verify_all runs the bytecode verifier on the script and on every function
+// prototype that has not been verified yet.
+static int verify_all(ObjectFunction *script, ValueArray *functions,
+                      Globals *globals)
+{
+  for (int i = 0; i < functions->len; i++) {
+    ObjectFunction *fun = as_function(functions->value[i]);
+    if (fun->verified) {
+      continue;
+    }
+    if (verify(fun, globals)) {
+      return 1;
+    }
+    fun->verified = true;
+  }
+  // The script chunk grows with every compile in the repl, so it is always
+  // verified again.
+  return verify(script, globals);
+}
+
+int compile(char *src, ObjectFunction *fun, ValueArray *functions,
+            Globals *globals)
 {
 #ifdef DEBUG
   time_t start = clock();
 #endif
 
-  int err = compile_chunk(src, &fun->chunk, constants);
+  int err = compile_chunk(src, fun, functions, globals);
 
 #ifdef DEBUG
   fprintf(stderr, "compile time: %ds\n", (clock() - start) / CLOCKS_PER_SEC);
 #endif
 
 #ifdef DEBUG
-  debug_chunk(&fun->chunk, constants, fun->name->str);
+  debug_chunk(&fun->chunk, &fun->constants, fun->name->str);
 #endif
 
+  if (!err) {
+    err = verify_all(fun, functions, globals);
+  }
+
   return err;
 }
@@ -2,6 +2,7 @@
 #define clox_compiler_h
 
 #include "chunk.h"
+#include "globals.h"
 #include "lexer.h"
 #include "map.h"
 #include "object.h"
@@ -21,12 +22,27 @@ typedef struct {
   Value name;
 } UpValue;
 
+// ConstTable finds the constants already in the pool of a function. Each
+// bucket holds 1 + the index of a constant, or 0 if it is empty.
+typedef struct {
+  int len;
+  int cap;
+  int *buckets;
+} ConstTable;
+
 typedef struct scope {
+  // fun is the function compiled in this scope
+  ObjectFunction *fun;
+  ConstTable constants;
   int sp;
+  // slot_size is the peak number of locals alive in this scope
+  int slot_size;
   int cur_depth;
   Local locals[UINT8_MAX + 1];
   int upvalue_size;
   UpValue upvalues[UINT8_MAX + 1];
+  // ic_size is the number of inline caches the function needs so far
+  int ic_size;
   struct scope *enclosing;
 } Scope;
 
@@ -34,9 +50,9 @@ typedef struct {
   Lexer lexer;
   Token curr;
   Token prev;
-  ValueArray *constants;
+  ValueArray *functions; // every function prototype compiled
+  Globals *globals;
   Map interned_strings;
-  Map mconstants; // map from value to idx in the constant list
   Scope *cur_scope;
   Chunk *cur_chunk; // Compiling chunk
 
@@ -54,6 +70,11 @@ typedef struct {
   char errmsg[128];
 } Compiler;
 
-int compile(char *, ObjectFunction *, ValueArray *);
+// compile_registers selects register mode, in which arithmetic, moves and
+// compare-and-jumps on locals and constants compile to register
+// instructions. It is on unless built with STACK_VM.
+extern bool compile_registers;
+
+int compile(char *, ObjectFunction *, ValueArray *, Globals *);
 
 #endif
@@ -14,10 +14,11 @@ void debug_chunk(Chunk *chunk, ValueArray *constants, char *name)
 int debug_instruction(Chunk *chunk, ValueArray *constants, int offset)
 {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = chunk_line(chunk, offset);
+  if (offset > 0 && line == chunk_line(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -61,14 +62,17 @@ int debug_instruction(Chunk *chunk, ValueArray *constants, int offset)
 
   case OP_CONSTANT:
     return constant_instruction("OP_CONSTANT", chunk, constants, offset);
+  case OP_CONSTANT_LONG:
+    return constant_long_instruction("OP_CONSTANT_LONG", chunk, constants,
+                                     offset);
   case OP_GLOBAL:
-    return constant_instruction("OP_GLOBAL", chunk, constants, offset);
+    return global_instruction("OP_GLOBAL", chunk, offset);
   case OP_LOCAL:
     return simple_instruction("OP_LOCAL", offset);
   case OP_SET_GLOBAL:
-    return constant_instruction("OP_SET_GLOBAL", chunk, constants, offset);
+    return global_instruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constant_instruction("OP_GET_GLOBAL", chunk, constants, offset);
+    return global_instruction("OP_GET_GLOBAL", chunk, offset);
   case OP_SET_LOCAL:
     return constant_instruction("OP_SET_LOCAL", chunk, NULL, offset);
   case OP_GET_LOCAL:
@@ -86,8 +90,8 @@ int debug_instruction(Chunk *chunk, ValueArray *constants, int offset)
     return jmp_instruction("OP_JMP_ON_FALSE", chunk, 1, offset);
 
   case OP_CLOSURE:
-    offset = constant_instruction("OP_CLOSURE", chunk, constants, offset);
-    int constant = chunk->code[offset - 1];
+    offset = constant_long_instruction("OP_CLOSURE", chunk, constants, offset);
+    int constant = (chunk->code[offset - 2] << 8) | chunk->code[offset - 1];
     ObjectFunction *fun = as_function(constants->value[constant]);
     for (int i = 0; i < fun->upvalue_size; i++) {
       int idx = chunk->code[offset++];
@@ -101,19 +105,106 @@ int debug_instruction(Chunk *chunk, ValueArray *constants, int offset)
     return constant_instruction("OP_CALL", chunk, NULL, offset);
 
   case OP_CLASS:
-    return constant_instruction("OP_CLASS", chunk, constants, offset);
+    return constant_long_instruction("OP_CLASS", chunk, constants, offset);
   case OP_GET_FIELD:
-    return constant_instruction("OP_GET_FIELD", chunk, constants, offset);
+    return property_instruction("OP_GET_FIELD", chunk, constants, offset);
   case OP_SET_FIELD:
-    return constant_instruction("OP_SET_FIELD", chunk, constants, offset);
+    return property_instruction("OP_SET_FIELD", chunk, constants, offset);
   case OP_METHOD:
-    return constant_instruction("OP_METHOD", chunk, constants, offset);
+    return selector_instruction("OP_METHOD", chunk, offset);
   case OP_INVOKE:
-    return invoke_instruction("OP_INVOKE", chunk, constants, offset);
+    return invoke_instruction("OP_INVOKE", chunk, offset);
   case OP_DERIVE:
     return simple_instruction("OP_DERIVE", offset);
   case OP_GET_SUPER:
-    return constant_instruction("OP_GET_SUPER", chunk, constants, offset);
+    return selector_instruction("OP_GET_SUPER", chunk, offset);
+  case OP_END_CLASS:
+    return simple_instruction("OP_END_CLASS", offset);
+
+  case OP_GET_LOCAL_GET_FIELD:
+    return local_property_instruction("OP_GET_LOCAL_GET_FIELD", chunk,
+                                      constants, offset);
+  case OP_ADD_CONST:
+    return constant_instruction("OP_ADD_CONST", chunk, constants, offset);
+  case OP_SET_LOCAL_POP:
+    return constant_instruction("OP_SET_LOCAL_POP", chunk, NULL, offset);
+  case OP_JMP_UNLESS_EQUAL:
+    return jmp_instruction("OP_JMP_UNLESS_EQUAL", chunk, 1, offset);
+  case OP_JMP_UNLESS_GREATER:
+    return jmp_instruction("OP_JMP_UNLESS_GREATER", chunk, 1, offset);
+  case OP_JMP_UNLESS_GREATER_EQUAL:
+    return jmp_instruction("OP_JMP_UNLESS_GREATER_EQUAL", chunk, 1, offset);
+  case OP_JMP_UNLESS_LESS:
+    return jmp_instruction("OP_JMP_UNLESS_LESS", chunk, 1, offset);
+  case OP_JMP_UNLESS_LESS_EQUAL:
+    return jmp_instruction("OP_JMP_UNLESS_LESS_EQUAL", chunk, 1, offset);
+
+  case OP_ADD_LL:
+    return register_instruction("OP_ADD_LL", chunk, NULL, 2, offset);
+  case OP_ADD_LC:
+    return register_instruction("OP_ADD_LC", chunk, constants, 2, offset);
+  case OP_ADD_LL_TO:
+    return register_instruction("OP_ADD_LL_TO", chunk, NULL, 3, offset);
+  case OP_ADD_LC_TO:
+    return register_instruction("OP_ADD_LC_TO", chunk, constants, 3, offset);
+  case OP_MINUS_LL:
+    return register_instruction("OP_MINUS_LL", chunk, NULL, 2, offset);
+  case OP_MINUS_LC:
+    return register_instruction("OP_MINUS_LC", chunk, constants, 2, offset);
+  case OP_MINUS_LL_TO:
+    return register_instruction("OP_MINUS_LL_TO", chunk, NULL, 3, offset);
+  case OP_MINUS_LC_TO:
+    return register_instruction("OP_MINUS_LC_TO", chunk, constants, 3, offset);
+  case OP_MUL_LL:
+    return register_instruction("OP_MUL_LL", chunk, NULL, 2, offset);
+  case OP_MUL_LC:
+    return register_instruction("OP_MUL_LC", chunk, constants, 2, offset);
+  case OP_MUL_LL_TO:
+    return register_instruction("OP_MUL_LL_TO", chunk, NULL, 3, offset);
+  case OP_MUL_LC_TO:
+    return register_instruction("OP_MUL_LC_TO", chunk, constants, 3, offset);
+  case OP_DIV_LL:
+    return register_instruction("OP_DIV_LL", chunk, NULL, 2, offset);
+  case OP_DIV_LC:
+    return register_instruction("OP_DIV_LC", chunk, constants, 2, offset);
+  case OP_DIV_LL_TO:
+    return register_instruction("OP_DIV_LL_TO", chunk, NULL, 3, offset);
+  case OP_DIV_LC_TO:
+    return register_instruction("OP_DIV_LC_TO", chunk, constants, 3, offset);
+  case OP_JMP_UNLESS_EQUAL_LL:
+    return register_jmp_instruction("OP_JMP_UNLESS_EQUAL_LL", chunk,
+                                    NULL, offset);
+  case OP_JMP_UNLESS_EQUAL_LC:
+    return register_jmp_instruction("OP_JMP_UNLESS_EQUAL_LC", chunk,
+                                    constants, offset);
+  case OP_JMP_UNLESS_GREATER_LL:
+    return register_jmp_instruction("OP_JMP_UNLESS_GREATER_LL", chunk,
+                                    NULL, offset);
+  case OP_JMP_UNLESS_GREATER_LC:
+    return register_jmp_instruction("OP_JMP_UNLESS_GREATER_LC", chunk,
+                                    constants, offset);
+  case OP_JMP_UNLESS_GREATER_EQUAL_LL:
+    return register_jmp_instruction("OP_JMP_UNLESS_GREATER_EQUAL_LL", chunk,
+                                    NULL, offset);
+  case OP_JMP_UNLESS_GREATER_EQUAL_LC:
+    return register_jmp_instruction("OP_JMP_UNLESS_GREATER_EQUAL_LC", chunk,
+                                    constants, offset);
+  case OP_JMP_UNLESS_LESS_LL:
+    return register_jmp_instruction("OP_JMP_UNLESS_LESS_LL", chunk,
+                                    NULL, offset);
+  case OP_JMP_UNLESS_LESS_LC:
+    return register_jmp_instruction("OP_JMP_UNLESS_LESS_LC", chunk,
+                                    constants, offset);
+  case OP_JMP_UNLESS_LESS_EQUAL_LL:
+    return register_jmp_instruction("OP_JMP_UNLESS_LESS_EQUAL_LL", chunk,
+                                    NULL, offset);
+  case OP_JMP_UNLESS_LESS_EQUAL_LC:
+    return register_jmp_instruction("OP_JMP_UNLESS_LESS_EQUAL_LC", chunk,
+                                    constants, offset);
+  case OP_MOVE:
+    return register_instruction("OP_MOVE", chunk, NULL, 2, offset);
+  case OP_LOAD_CONST:
+    return register_instruction("OP_LOAD_CONST", chunk, constants, 2, offset);
 
   default:
     printf("Unknown opcode %d\n", instruction);
@@ -139,6 +230,55 @@ int constant_instruction(char *name, Chunk *chunk, ValueArray *constants,
   return offset + 2;
 }
 
+int constant_long_instruction(char *name, Chunk *chunk, ValueArray *constants,
+                              int offset)
+{
+  int constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  printf("%-16s %4d '", name, constant);
+  value_print(constants->value[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+int global_instruction(char *name, Chunk *chunk, int offset)
+{
+  int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+int selector_instruction(char *name, Chunk *chunk, int offset)
+{
+  int selector = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  printf("%-16s %4d '%s'\n", name, selector, selector_name(selector)->str);
+  return offset + 3;
+}
+
+int property_instruction(char *name, Chunk *chunk, ValueArray *constants,
+                         int offset)
+{
+  int field = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  int ic = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+
+  printf("%-16s %4d '", name, field);
+  value_print(constants->value[field]);
+  printf("' ic %d\n", ic);
+  return offset + 5;
+}
+
+int local_property_instruction(char *name, Chunk *chunk,
+                               ValueArray *constants, int offset)
+{
+  int slot = chunk->code[offset + 1];
+  int field = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  int ic = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+
+  printf("%-16s %4d %4d '", name, slot, field);
+  value_print(constants->value[field]);
+  printf("' ic %d\n", ic);
+  return offset + 6;
+}
+
 int jmp_instruction(char *name, Chunk *chunk, int sign, int offset)
 {
   int h8 = chunk->code[offset + 1]; // high 8 bit
@@ -148,16 +288,46 @@ int jmp_instruction(char *name, Chunk *chunk, int sign, int offset)
   return offset + 3;
 }
 
-int invoke_instruction(char *name, Chunk *chunk, ValueArray *constants,
-                       int offset)
+int invoke_instruction(char *name, Chunk *chunk, int offset)
 {
   int arity = chunk->code[offset + 1];
-  int filed = chunk->code[offset + 2];
+  int selector = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  int ic = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+
+  printf("%-16s %4d %4d '%s' ic %d\n", name, arity, selector,
+         selector_name(selector)->str, ic);
+  return offset + 6;
+}
 
-  printf("%-16s %4d %4d '", name, arity, filed);
+// register_operands prints the n operands of the register instruction at
+// offset. If constants is not NULL the last one is a constant.
+static void register_operands(char *name, Chunk *chunk, ValueArray *constants,
+                              int n, int offset)
+{
+  printf("%-16s", name);
+  for (int i = 1; i <= n; i++) {
+    printf(" %4d", chunk->code[offset + i]);
+  }
   if (constants != NULL) {
-    value_print(constants->value[filed]);
+    printf(" '");
+    value_print(constants->value[chunk->code[offset + n]]);
+    printf("'");
   }
-  printf("'\n");
-  return offset + 3;
+}
+
+int register_instruction(char *name, Chunk *chunk, ValueArray *constants,
+                         int n, int offset)
+{
+  register_operands(name, chunk, constants, n, offset);
+  printf("\n");
+  return offset + 1 + n;
+}
+
+int register_jmp_instruction(char *name, Chunk *chunk, ValueArray *constants,
+                             int offset)
+{
+  register_operands(name, chunk, constants, 2, offset);
+  int dist = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf(" %4d\n", dist);
+  return offset + 5;
 }
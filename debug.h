@@ -18,7 +18,14 @@ int debug_instruction(Chunk *, ValueArray *, int);
 
 int simple_instruction(char *, int);
 int constant_instruction(char *, Chunk *, ValueArray *, int);
+int constant_long_instruction(char *, Chunk *, ValueArray *, int);
+int global_instruction(char *, Chunk *, int);
+int selector_instruction(char *, Chunk *, int);
+int property_instruction(char *, Chunk *, ValueArray *, int);
+int local_property_instruction(char *, Chunk *, ValueArray *, int);
 int jmp_instruction(char *, Chunk *, int, int);
-int invoke_instruction(char *, Chunk *, ValueArray *, int);
+int invoke_instruction(char *, Chunk *, int);
+int register_instruction(char *, Chunk *, ValueArray *, int, int);
+int register_jmp_instruction(char *, Chunk *, ValueArray *, int);
 
 #endif
@@ -0,0 +1,21 @@
+#include "globals.h"
+
+void globals_init(Globals *globals)
+{
+  map_init(&globals->slots);
+  value_array_init(&globals->names);
+  value_array_init(&globals->values);
+}
+
+int globals_slot(Globals *globals, Value name)
+{
+  Value slot;
+  if (map_get(&globals->slots, name, &slot)) {
+    return (int)as_number(slot);
+  }
+  int idx = globals->names.len;
+  map_put(&globals->slots, name, value_make_number(idx));
+  value_array_write(&globals->names, name);
+  value_array_write(&globals->values, value_make_undef());
+  return idx;
+}
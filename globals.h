@@ -0,0 +1,27 @@
+#ifndef clox_globals_h
+#define clox_globals_h
+
+#include "map.h"
+#include "value.h"
+
+// GLOBALS_MAX is the number of global variables, whose slots are encoded in
+// two bytes.
+#define GLOBALS_MAX (UINT16_MAX + 1)
+
+// Globals holds the global variables. The compiler resolves every global
+// name to a slot the first time it meets it, and the vm reads and writes
+// the slot directly. A slot holds undef until its variable is defined, so
+// using a variable before its definition is still a runtime error.
+typedef struct {
+  Map slots;         // slot index of every name
+  ValueArray names;  // name of every slot
+  ValueArray values; // value of every slot
+} Globals;
+
+void globals_init(Globals *);
+
+// globals_slot returns the slot of name, adding an undefined one if name has
+// none yet.
+int globals_slot(Globals *, Value name);
+
+#endif
@@ -0,0 +1,656 @@
+#include <string.h>
+
+#include "cache.h"
+#include "image.h"
+#include "memory.h"
+#include "serial.h"
+#include "shape.h"
+#include "verify.h"
+
+// The image is a header followed by a body holding the global and selector
+// names, the objects, and the values of the globals. Objects refer to each
+// other by their index in the image. Each is written twice: first what it
+// takes to allocate it, then its references to other objects. The loader
+// allocates every object before it fills in any reference, so cycles need
+// no care. Objects are sorted by type, which puts the objects needed to
+// allocate another one, such as the prototype of a closure or the class of
+// an instance, before it.
+//
+// The collector only manages objects in its own pages, so the objects are
+// copied out of the mapped file rather than used in place. The shapes and
+// inline caches are not written: instances get their fields back in slot
+// order, which rebuilds the same shapes, and the caches start out empty.
+#define IMAGE_MAGIC 0x494f584c // "LOXI"
+
+typedef enum {
+  VAL_NIL,
+  VAL_FALSE,
+  VAL_TRUE,
+  VAL_UNDEF,
+  VAL_NUMBER,
+  VAL_OBJECT,
+} value_tag;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t bytecode; // CACHE_VERSION of the code
+  uint32_t object_len;
+  uint64_t body_len;
+  uint64_t body_hash;
+} Header;
+
+// native_index returns the index of a native in vm_natives, or -1 if it is
+// not there.
+static int native_index(ObjectNative *native)
+{
+  for (int i = 0; i < vm_native_count; i++) {
+    if (vm_natives[i].method == native->method) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// instance_items writes the name and the value of every field of ins into
+// items, in slot order.
+static void instance_items(ObjectInstance *ins, ValueArray *items)
+{
+  if (ins->shape->dictionary) {
+    MapIter iter;
+    map_iter_init(&iter, ins->dict);
+    while (map_iter_next(&iter)) {
+      value_array_write(items, iter.key);
+      value_array_write(items, iter.val);
+    }
+    return;
+  }
+  for (int i = 0; i < ins->shape->size; i++) {
+    value_array_write(items, value_make_object((Object *)ins->shape->names[i]));
+    value_array_write(items, *instance_field(ins, i));
+  }
+}
+
+// Heap numbers the objects reachable from the globals.
+typedef struct {
+  Map index;          // index of every object found, as a number
+  ValueArray objects; // every object found, by index
+} Heap;
+
+static void heap_add(Heap *heap, Value value)
+{
+  Value index;
+  if (!is_object(value) || map_get(&heap->index, value, &index)) {
+    return;
+  }
+  map_put(&heap->index, value, value_make_number(heap->objects.len));
+  value_array_write(&heap->objects, value);
+}
+
+static void heap_add_object(Heap *heap, void *obj)
+{
+  heap_add(heap, value_make_object((Object *)obj));
+}
+
+// heap_trace adds the objects obj refers to, and returns whether obj can be
+// written at all.
+static bool heap_trace(Heap *heap, Object *obj)
+{
+  switch (obj->type) {
+  case OBJ_STRING:
+    return true;
+
+  case OBJ_FUNCTION: {
+    ObjectFunction *fun = (ObjectFunction *)obj;
+    heap_add_object(heap, fun->name);
+    for (int i = 0; i < fun->constants.len; i++) {
+      heap_add(heap, fun->constants.value[i]);
+    }
+    return true;
+  }
+
+  case OBJ_UPVALUE: {
+    // Upvalues still open point into the stack of a running program.
+    ObjectUpValue *upvalue = (ObjectUpValue *)obj;
+    heap_add(heap, upvalue->closed);
+    return upvalue->location == &upvalue->closed;
+  }
+
+  case OBJ_CLOSURE: {
+    ObjectClosure *closure = (ObjectClosure *)obj;
+    heap_add_object(heap, closure->proto);
+    for (int i = 0; i < closure->upvalue_size; i++) {
+      if (closure->upvalues[i] == NULL) {
+        return false;
+      }
+      heap_add_object(heap, closure->upvalues[i]);
+    }
+    return true;
+  }
+
+  case OBJ_NATIVE:
+    return native_index((ObjectNative *)obj) >= 0;
+
+  case OBJ_CLASS: {
+    ObjectClass *klass = (ObjectClass *)obj;
+    heap_add_object(heap, klass->name);
+    for (int i = 0; i < klass->method_size; i++) {
+      if (klass->methods[i] != NULL) {
+        heap_add_object(heap, klass->methods[i]);
+      }
+    }
+    return true;
+  }
+
+  case OBJ_INSTANCE: {
+    ObjectInstance *ins = (ObjectInstance *)obj;
+    heap_add_object(heap, ins->klass);
+    ValueArray items;
+    value_array_init(&items);
+    instance_items(ins, &items);
+    for (int i = 0; i < items.len; i++) {
+      heap_add(heap, items.value[i]);
+    }
+    value_array_free(&items);
+    return true;
+  }
+
+  case OBJ_BOUND_METHOD: {
+    ObjectBoundMethod *bm = (ObjectBoundMethod *)obj;
+    heap_add_object(heap, bm->method);
+    heap_add_object(heap, bm->receiver);
+    return true;
+  }
+  }
+  return false;
+}
+
+// heap_sort renumbers the objects by type.
+static void heap_sort(Heap *heap)
+{
+  ValueArray sorted;
+  value_array_init(&sorted);
+  for (int type = OBJ_STRING; type <= OBJ_BOUND_METHOD; type++) {
+    for (int i = 0; i < heap->objects.len; i++) {
+      Value value = heap->objects.value[i];
+      if (as_object(value)->type == type) {
+        map_put(&heap->index, value, value_make_number(sorted.len));
+        value_array_write(&sorted, value);
+      }
+    }
+  }
+  value_array_free(&heap->objects);
+  heap->objects = sorted;
+}
+
+static void put_ref(Writer *w, Heap *heap, void *obj)
+{
+  Value index;
+  map_get(&heap->index, value_make_object((Object *)obj), &index);
+  put_u32(w, (uint32_t)as_number(index));
+}
+
+static void put_value(Writer *w, Heap *heap, Value value)
+{
+  if (is_nil(value)) {
+    put_u8(w, VAL_NIL);
+  } else if (is_bool(value)) {
+    put_u8(w, as_bool(value) ? VAL_TRUE : VAL_FALSE);
+  } else if (is_undef(value)) {
+    put_u8(w, VAL_UNDEF);
+  } else if (is_number(value)) {
+    put_u8(w, VAL_NUMBER);
+    put_f64(w, as_number(value));
+  } else {
+    put_u8(w, VAL_OBJECT);
+    put_ref(w, heap, as_object(value));
+  }
+}
+
+// put_object writes what it takes to allocate obj.
+static void put_object(Writer *w, Heap *heap, Object *obj)
+{
+  put_u8(w, obj->type);
+  switch (obj->type) {
+  case OBJ_STRING:
+    put_string(w, (ObjectString *)obj);
+    break;
+
+  case OBJ_FUNCTION: {
+    ObjectFunction *fun = (ObjectFunction *)obj;
+    put_ref(w, heap, fun->name);
+    put_u32(w, fun->arity);
+    put_u32(w, fun->upvalue_size);
+    put_u32(w, fun->slot_size);
+    put_u32(w, fun->ic_size);
+    put_chunk(w, &fun->chunk);
+    break;
+  }
+
+  case OBJ_CLOSURE:
+    put_ref(w, heap, ((ObjectClosure *)obj)->proto);
+    break;
+
+  case OBJ_NATIVE:
+    put_u32(w, native_index((ObjectNative *)obj));
+    break;
+
+  case OBJ_CLASS: {
+    ObjectClass *klass = (ObjectClass *)obj;
+    put_ref(w, heap, klass->name);
+    put_u32(w, klass->inline_size);
+    break;
+  }
+
+  case OBJ_INSTANCE:
+    put_ref(w, heap, ((ObjectInstance *)obj)->klass);
+    break;
+
+  case OBJ_BOUND_METHOD: {
+    ObjectBoundMethod *bm = (ObjectBoundMethod *)obj;
+    put_ref(w, heap, bm->method);
+    put_ref(w, heap, bm->receiver);
+    break;
+  }
+  }
+}
+
+// put_references writes the references of obj to other objects.
+static void put_references(Writer *w, Heap *heap, Object *obj)
+{
+  switch (obj->type) {
+  case OBJ_FUNCTION: {
+    ObjectFunction *fun = (ObjectFunction *)obj;
+    put_u32(w, fun->constants.len);
+    for (int i = 0; i < fun->constants.len; i++) {
+      put_value(w, heap, fun->constants.value[i]);
+    }
+    break;
+  }
+
+  case OBJ_UPVALUE:
+    put_value(w, heap, ((ObjectUpValue *)obj)->closed);
+    break;
+
+  case OBJ_CLOSURE: {
+    ObjectClosure *closure = (ObjectClosure *)obj;
+    for (int i = 0; i < closure->upvalue_size; i++) {
+      put_ref(w, heap, closure->upvalues[i]);
+    }
+    break;
+  }
+
+  case OBJ_CLASS: {
+    ObjectClass *klass = (ObjectClass *)obj;
+    int count = 0;
+    for (int i = 0; i < klass->method_size; i++) {
+      count += klass->methods[i] != NULL;
+    }
+    put_u32(w, count);
+    for (int i = 0; i < klass->method_size; i++) {
+      if (klass->methods[i] != NULL) {
+        put_u32(w, i);
+        put_ref(w, heap, klass->methods[i]);
+      }
+    }
+    break;
+  }
+
+  case OBJ_INSTANCE: {
+    ValueArray items;
+    value_array_init(&items);
+    instance_items((ObjectInstance *)obj, &items);
+    put_u32(w, items.len / 2);
+    for (int i = 0; i < items.len; i += 2) {
+      put_ref(w, heap, as_object(items.value[i]));
+      put_value(w, heap, items.value[i + 1]);
+    }
+    value_array_free(&items);
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+int image_write(const char *path, VM *vm)
+{
+  Globals *globals = &vm->globals;
+  Heap heap;
+  map_init(&heap.index);
+  value_array_init(&heap.objects);
+  for (int i = 0; i < globals->values.len; i++) {
+    heap_add(&heap, globals->values.value[i]);
+  }
+  bool ok = true;
+  for (int i = 0; ok && i < heap.objects.len; i++) {
+    ok = heap_trace(&heap, as_object(heap.objects.value[i]));
+  }
+
+  int err = 1;
+  if (ok) {
+    heap_sort(&heap);
+    Writer w;
+    writer_init(&w);
+    put_slots(&w, globals);
+    for (int i = 0; i < heap.objects.len; i++) {
+      put_object(&w, &heap, as_object(heap.objects.value[i]));
+    }
+    for (int i = 0; i < heap.objects.len; i++) {
+      put_references(&w, &heap, as_object(heap.objects.value[i]));
+    }
+    put_u32(&w, globals->values.len);
+    for (int i = 0; i < globals->values.len; i++) {
+      put_value(&w, &heap, globals->values.value[i]);
+    }
+
+    Header header = {
+      .magic = IMAGE_MAGIC,
+      .version = IMAGE_VERSION,
+      .bytecode = CACHE_VERSION,
+      .object_len = heap.objects.len,
+      .body_len = w.len,
+      .body_hash = hash64(w.buf, w.len),
+    };
+    err = write_file(path, &header, sizeof(header), &w);
+    writer_free(&w);
+  }
+
+  map_free(&heap.index);
+  value_array_free(&heap.objects);
+  return err;
+}
+
+// Loader restores the objects of an image into a vm.
+typedef struct {
+  Reader r;
+  VM *vm;
+  Object **objects; // every object of the image, once allocated
+  uint32_t size;    // the number of objects in the image
+  uint32_t len;     // the number of objects allocated so far
+} Loader;
+
+// get_ref reads a reference to an object allocated already, and returns it
+// if it has the given type, else NULL.
+static Object *get_ref(Loader *l, object_t type)
+{
+  uint32_t idx = get_u32(&l->r);
+  if (l->r.bad || idx >= l->len || l->objects[idx]->type != type) {
+    return NULL;
+  }
+  return l->objects[idx];
+}
+
+// get_value reads a value. Only global variables may be undefined.
+static bool get_value(Loader *l, Value *value, bool undef)
+{
+  uint8_t tag = get_u8(&l->r);
+  switch (tag) {
+  case VAL_NIL:
+    *value = value_make_nil();
+    break;
+  case VAL_FALSE:
+  case VAL_TRUE:
+    *value = value_make_bool(tag == VAL_TRUE);
+    break;
+  case VAL_UNDEF:
+    if (!undef) {
+      return false;
+    }
+    *value = value_make_undef();
+    break;
+  case VAL_NUMBER:
+    *value = value_make_number(get_f64(&l->r));
+    break;
+  case VAL_OBJECT: {
+    uint32_t idx = get_u32(&l->r);
+    if (idx >= l->len) {
+      return false;
+    }
+    *value = value_make_object(l->objects[idx]);
+    break;
+  }
+  default:
+    return false;
+  }
+  return !l->r.bad;
+}
+
+static Object *get_function(Loader *l)
+{
+  Reader *r = &l->r;
+  ObjectString *name = (ObjectString *)get_ref(l, OBJ_STRING);
+  uint32_t arity = get_u32(r);
+  uint32_t upvalue_size = get_u32(r);
+  uint32_t slot_size = get_u32(r);
+  uint32_t ic_size = get_u32(r);
+  if (r->bad || name == NULL || arity > UINT8_MAX
+      || upvalue_size > UINT8_MAX + 1 || slot_size > UINT8_MAX + 1
+      || ic_size > UINT16_MAX + 1) {
+    return NULL;
+  }
+  ObjectFunction *fun = (ObjectFunction *)fun_new(arity, name);
+  fun->upvalue_size = upvalue_size;
+  fun->slot_size = slot_size;
+  fun_init_ics(fun, ic_size);
+  value_array_write(&l->vm->functions, value_make_object((Object *)fun));
+  if (!get_chunk(r, &fun->chunk)) {
+    return NULL;
+  }
+  return (Object *)fun;
+}
+
+// get_object allocates the next object of the image.
+static Object *get_object(Loader *l)
+{
+  Reader *r = &l->r;
+  uint8_t type = get_u8(r);
+  if (r->bad) {
+    return NULL;
+  }
+  switch (type) {
+  case OBJ_STRING:
+    return (Object *)get_string(r);
+
+  case OBJ_FUNCTION:
+    return get_function(l);
+
+  case OBJ_UPVALUE: {
+    ObjectUpValue *upvalue = upvalue_new(NULL);
+    upvalue->location = &upvalue->closed;
+    return (Object *)upvalue;
+  }
+
+  case OBJ_CLOSURE: {
+    ObjectFunction *proto = (ObjectFunction *)get_ref(l, OBJ_FUNCTION);
+    return proto != NULL ? (Object *)closure_new(proto) : NULL;
+  }
+
+  case OBJ_NATIVE: {
+    uint32_t idx = get_u32(r);
+    if (r->bad || idx >= (uint32_t)vm_native_count) {
+      return NULL;
+    }
+    const NativeDef *def = &vm_natives[idx];
+    return as_object(value_make_native(def->arity, def->method));
+  }
+
+  case OBJ_CLASS: {
+    ObjectString *name = (ObjectString *)get_ref(l, OBJ_STRING);
+    uint32_t inline_size = get_u32(r);
+    if (name == NULL || inline_size > INSTANCE_INLINE_MAX) {
+      return NULL;
+    }
+    ObjectClass *klass = class_new(name);
+    klass->inline_size = inline_size;
+    return (Object *)klass;
+  }
+
+  case OBJ_INSTANCE: {
+    ObjectClass *klass = (ObjectClass *)get_ref(l, OBJ_CLASS);
+    return klass != NULL ? (Object *)instance_new(klass) : NULL;
+  }
+
+  case OBJ_BOUND_METHOD: {
+    ObjectClosure *method = (ObjectClosure *)get_ref(l, OBJ_CLOSURE);
+    ObjectInstance *receiver = (ObjectInstance *)get_ref(l, OBJ_INSTANCE);
+    if (method == NULL || receiver == NULL) {
+      return NULL;
+    }
+    return (Object *)bound_method_new(method, receiver);
+  }
+
+  default:
+    return NULL;
+  }
+}
+
+// get_references fills in the references of obj to other objects.
+static bool get_references(Loader *l, Object *obj)
+{
+  Reader *r = &l->r;
+  switch (obj->type) {
+  case OBJ_FUNCTION: {
+    ObjectFunction *fun = (ObjectFunction *)obj;
+    uint32_t const_len = get_u32(r);
+    if (r->bad || const_len > UINT16_MAX + 1) {
+      return false;
+    }
+    for (uint32_t i = 0; i < const_len; i++) {
+      Value value;
+      if (!get_value(l, &value, false)) {
+        return false;
+      }
+      value_array_write(&fun->constants, value);
+    }
+    return true;
+  }
+
+  case OBJ_UPVALUE:
+    return get_value(l, &((ObjectUpValue *)obj)->closed, false);
+
+  case OBJ_CLOSURE: {
+    ObjectClosure *closure = (ObjectClosure *)obj;
+    for (int i = 0; i < closure->upvalue_size; i++) {
+      closure->upvalues[i] = (ObjectUpValue *)get_ref(l, OBJ_UPVALUE);
+      if (closure->upvalues[i] == NULL) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  case OBJ_CLASS: {
+    ObjectClass *klass = (ObjectClass *)obj;
+    uint32_t count = get_u32(r);
+    for (uint32_t i = 0; !r->bad && i < count; i++) {
+      uint32_t selector = get_u32(r);
+      ObjectClosure *method = (ObjectClosure *)get_ref(l, OBJ_CLOSURE);
+      if (method == NULL || selector >= (uint32_t)selector_count()) {
+        return false;
+      }
+      class_add_method(klass, selector, method);
+    }
+    class_seal(klass);
+    return !r->bad;
+  }
+
+  case OBJ_INSTANCE: {
+    ObjectInstance *ins = (ObjectInstance *)obj;
+    uint32_t count = get_u32(r);
+    for (uint32_t i = 0; !r->bad && i < count; i++) {
+      ObjectString *name = (ObjectString *)get_ref(l, OBJ_STRING);
+      Value value;
+      if (name == NULL || !get_value(l, &value, false)) {
+        return false;
+      }
+      instance_set(ins, name, value);
+    }
+    return !r->bad;
+  }
+
+  default:
+    return true;
+  }
+}
+
+static bool load(Loader *l)
+{
+  Reader *r = &l->r;
+  VM *vm = l->vm;
+  Header header;
+  const uint8_t *bytes = get_bytes(r, sizeof(header));
+  if (bytes == NULL) {
+    return false;
+  }
+  memcpy(&header, bytes, sizeof(header));
+  // Every object takes at least a byte of the body.
+  if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION
+      || header.bytecode != CACHE_VERSION
+      || header.body_len != (uint64_t)(r->end - r->pos)
+      || header.object_len > header.body_len
+      || header.body_hash != hash64(r->pos, header.body_len)) {
+    return false;
+  }
+
+  if (!get_slots(r, &vm->globals)) {
+    return false;
+  }
+
+  l->size = header.object_len;
+  l->objects = grow_array(Object *, NULL, 0, l->size);
+  for (uint32_t i = 0; i < l->size; i++) {
+    Object *obj = get_object(l);
+    if (obj == NULL) {
+      return false;
+    }
+    l->objects[l->len++] = obj;
+  }
+  for (uint32_t i = 0; i < l->size; i++) {
+    if (!get_references(l, l->objects[i])) {
+      return false;
+    }
+  }
+
+  Globals *globals = &vm->globals;
+  uint32_t global_len = get_u32(r);
+  if (r->bad || global_len != (uint32_t)globals->values.len) {
+    return false;
+  }
+  for (uint32_t i = 0; i < global_len; i++) {
+    if (!get_value(l, &globals->values.value[i], true)) {
+      return false;
+    }
+  }
+  if (r->pos != r->end) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < l->size; i++) {
+    if (object_is(l->objects[i], OBJ_FUNCTION)) {
+      ObjectFunction *fun = (ObjectFunction *)l->objects[i];
+      if (verify(fun, globals)) {
+        return false;
+      }
+      fun->verified = true;
+    }
+  }
+  return true;
+}
+
+int image_load(const char *path, VM *vm)
+{
+  Loader l;
+  if (map_file(path, &l.r)) {
+    return 1;
+  }
+  l.vm = vm;
+  l.objects = NULL;
+  l.size = 0;
+  l.len = 0;
+  bool ok = load(&l);
+  unmap_file(&l.r);
+  free_array(Object *, l.objects, l.size);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "vm.h"
+
+// A heap image holds the state a program leaves in the vm: every global
+// variable and every object reachable from one, such as classes, closures,
+// instances and strings, along with the code of their functions. A vm
+// restored from an image starts where the program that wrote it ended,
+// without running it again.
+//
+// Bump IMAGE_VERSION whenever the layout of the image changes. Images are
+// also tied to the bytecode by CACHE_VERSION.
+#define IMAGE_VERSION 1
+
+// image_write writes the heap of vm, which must not be running, to path. It
+// returns 0 on success.
+int image_write(const char *path, VM *vm);
+
+// image_load restores the image at path into vm, which vm_init has just
+// set up. The code is verified before it is used. It returns 0 on success;
+// otherwise vm may hold part of the image and must not be run.
+int image_load(const char *path, VM *vm);
+
+#endif
@@ -2,17 +2,34 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "image.h"
 #include "lexer.h"
+#include "slab.h"
 #include "vm.h"
 
 VM vm;
 
+// profile_path is where the profile report goes, NULL if not profiling
+static const char *profile_path = NULL;
+
+// gc_stats is set if the collector statistics are reported on exit
+static bool gc_stats = false;
+
+// use_cache is cleared if scripts are always compiled from source
+static bool use_cache = true;
+
+// image_path is the heap image to start from, and snapshot_path where the
+// heap is written once the program is done; NULL if none
+static const char *image_path = NULL;
+static const char *snapshot_path = NULL;
+
 void interprete(char *src)
 {
-  int err = compile(src, as_function(vm.vmain), &vm.constants);
+  int err = compile(src, as_function(vm.vmain), &vm.functions, &vm.globals);
   if (err) {
     exit(74);
   }
@@ -63,23 +80,138 @@ static char *read_file(const char *filename)
   return buf;
 }
 
+// run_file runs the script at filename, from its bytecode cache if it has
+// a valid one. Otherwise the script is compiled and the cache written.
 static void run_file(const char *filename)
 {
   char *src = read_file(filename);
-  interprete(src);
+  if (!use_cache) {
+    interprete(src);
+    return;
+  }
+
+  ObjectFunction *script = as_function(vm.vmain);
+  char *cache = cache_path(filename);
+  if (cache == NULL
+      || cache_load(cache, src, script, &vm.functions, &vm.globals)) {
+    if (compile(src, script, &vm.functions, &vm.globals)) {
+      exit(74);
+    }
+    // The cache only saves time, so failing to write it is not an error.
+    if (cache != NULL) {
+      cache_write(cache, src, script, &vm.globals);
+    }
+  }
+  free(cache);
+  vm_run(&vm);
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: clox [--profile[=report]] [--gc-pause=us] "
+                  "[--gc-stats] [--no-cache] [--stack|--registers] "
+                  "[--image=file] [--snapshot=file] [path]\n");
+  exit(64);
+}
+
+// write_profile writes the profile report when the program exits, also after
+// a compile error.
+static void write_profile()
+{
+  if (profile_write(vm.profile, profile_path, as_function(vm.vmain),
+                    &vm.functions)) {
+    exit(74);
+  }
+}
+
+static void write_gc_stats()
+{
+  GCStats *stats = &vm.gc_stats;
+  fprintf(stderr,
+          "gc: %llu minor, %llu full, %llu pauses, "
+          "max pause %.3f ms, total %.3f ms\n",
+          (unsigned long long)stats->minor, (unsigned long long)stats->full,
+          (unsigned long long)stats->pauses, stats->max_pause / 1e6,
+          stats->total_pause / 1e6);
+
+  // Slots hold more than their object up to the next size class, and pages
+  // keep free slots.
+  SlabStats heap;
+  slab_stats(&heap);
+  double internal
+      = heap.slots ? 100.0 * (heap.slots - heap.objects) / heap.slots : 0;
+  double external
+      = heap.reserved ? 100.0 * (heap.reserved - heap.slots) / heap.reserved
+                      : 0;
+  fprintf(stderr,
+          "heap: %d pages (%d large), %zu KB reserved, %zu KB in objects, "
+          "fragmentation %.1f%% in slots, %.1f%% in pages\n",
+          heap.pages, heap.large, heap.reserved / 1024, heap.objects / 1024,
+          internal, external);
 }
 
 int main(int argc, char **argv)
 {
   vm_init(&vm);
 
-  if (argc == 1) {
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (strcmp(argv[arg], "--profile") == 0) {
+      profile_path = "clox-profile.json";
+    } else if (strncmp(argv[arg], "--profile=", 10) == 0) {
+      profile_path = argv[arg] + 10;
+    } else if (strncmp(argv[arg], "--gc-pause=", 11) == 0) {
+      char *end;
+      unsigned long us = strtoul(argv[arg] + 11, &end, 10);
+      if (end == argv[arg] + 11 || *end != '\0') {
+        usage();
+      }
+      vm.gc_pause = (uint64_t)us * 1000;
+    } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+      gc_stats = true;
+    } else if (strcmp(argv[arg], "--no-cache") == 0) {
+      use_cache = false;
+    } else if (strcmp(argv[arg], "--stack") == 0) {
+      compile_registers = false;
+    } else if (strcmp(argv[arg], "--registers") == 0) {
+      compile_registers = true;
+    } else if (strncmp(argv[arg], "--image=", 8) == 0) {
+      image_path = argv[arg] + 8;
+    } else if (strncmp(argv[arg], "--snapshot=", 11) == 0) {
+      snapshot_path = argv[arg] + 11;
+    } else {
+      usage();
+    }
+  }
+  if (profile_path != NULL) {
+    vm.profile = profile_new();
+    atexit(write_profile);
+  }
+  if (gc_stats) {
+    atexit(write_gc_stats);
+  }
+
+  if (arg < argc - 1) {
+    usage();
+  }
+  // The image gives globals and selectors their slots, so it goes before
+  // any code is compiled.
+  if (image_path != NULL && image_load(image_path, &vm)) {
+    fprintf(stderr, "Could not load image \"%s\".\n", image_path);
+    exit(74);
+  }
+
+  if (arg == argc) {
     repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    run_file(argv[arg]);
+  }
+
+  // A program which failed may have left the heap half updated.
+  if (snapshot_path != NULL && !vm.error
+      && image_write(snapshot_path, &vm)) {
+    fprintf(stderr, "Could not write image \"%s\".\n", snapshot_path);
+    exit(74);
   }
 
   return 0;
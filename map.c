@@ -1,141 +1,420 @@
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "map.h"
 #include "memory.h"
+#include "object.h"
+
+// A control byte is negative for a free slot, and holds h2 of the hash of
+// the key otherwise. A deleted slot keeps the probe sequences going through
+// it, an empty one ends them.
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+#define h1(hash) ((hash) >> 7)
+#define h2(hash) ((int8_t)((hash)&0x7f))
+
+#define MAP_INIT_SIZE MAP_GROUP
+
+// A group mask has bit i set if slot i of the group matches.
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+
+static inline GroupMask group_match(const int8_t *ctrl, int8_t h)
+{
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h)));
+}
+
+// group_free matches the empty and deleted slots, the ones with the sign bit.
+static inline GroupMask group_free(const int8_t *ctrl)
+{
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
 
-#define ITEM_FREE 0
-#define ITEM_USED 1
-#define ITEM_TOMB 2
+#else
 
-#define is_free(item) (item.tag == ITEM_FREE)
-#define is_used(item) (item.tag == ITEM_USED)
-#define is_tomb(item) (item.tag == ITEM_TOMB)
+static inline GroupMask group_match(const int8_t *ctrl, int8_t h)
+{
+  GroupMask mask = 0;
+  for (int i = 0; i < MAP_GROUP; i++) {
+    mask |= (GroupMask)(ctrl[i] == h) << i;
+  }
+  return mask;
+}
+
+static inline GroupMask group_free(const int8_t *ctrl)
+{
+  GroupMask mask = 0;
+  for (int i = 0; i < MAP_GROUP; i++) {
+    mask |= (GroupMask)(ctrl[i] < 0) << i;
+  }
+  return mask;
+}
+
+#endif
+
+#define group_empty(ctrl) group_match(ctrl, CTRL_EMPTY)
 
-#define MAP_INIT_SIZE 8
+// Probing visits the groups in triangular steps, which reaches every group
+// since their count is a power of two.
+#define probe_start(map, hash) (h1(hash) & ((map)->size / MAP_GROUP - 1))
+#define probe_next(map, group, step)                                           \
+  (((group) + (step)) & ((map)->size / MAP_GROUP - 1))
+
+// Most keys are strings, which are interned and keep their hash, so the
+// common case needs no call into value.c.
+static inline uint32_t key_hash(Value key)
+{
+  if (is_object(key) && as_object(key)->type == OBJ_STRING) {
+    return as_string(key)->hash;
+  }
+  return value_hash(key);
+}
 
-static void item_list_init(MapItem *items, unsigned int size)
+static inline bool key_equal(Value a, Value b)
 {
-  for (int i = 0; i < size; i++) {
-    items[i].tag = ITEM_FREE;
+  if (is_object(a)) {
+    return is_object(b) && as_object(a) == as_object(b);
   }
+  return value_equal(a, b);
+}
+
+// A map is filled up to 7/8 of its slots, so every probe meets an empty slot.
+static unsigned int capacity(unsigned int size) { return size - size / 8; }
+
+static size_t table_bytes(unsigned int size)
+{
+  return (size_t)size * (sizeof(MapItem) + 1);
 }
 
-static void _map_init(Map *map, unsigned int size)
+static void table_init(Map *map, unsigned int size)
 {
   map->size = size;
   map->used = 0;
-  map->items = grow_array(MapItem, NULL, 0, size);
-  item_list_init(map->items, map->size);
+  map->growth_left = capacity(size);
+  // The items come first, keeping the control bytes aligned to a group.
+  map->items = (MapItem *)reallocate(NULL, 0, table_bytes(size));
+  map->ctrl = (int8_t *)(map->items + size);
+  memset(map->ctrl, CTRL_EMPTY, size);
+}
+
+void map_init(Map *map)
+{
+  map->size = 0;
+  map->used = 0;
+  map->growth_left = 0;
+}
+
+void map_free(Map *map)
+{
+  if (map->size != 0) {
+    reallocate(map->items, table_bytes(map->size), 0);
+  }
+  map_init(map);
 }
 
-void map_init(Map *map) { _map_init(map, MAP_INIT_SIZE); }
+// small_find returns the index of key among the items of a small map, or -1
+// if there is none.
+static int small_find(Map *map, Value key)
+{
+  for (unsigned int i = 0; i < map->used; i++) {
+    if (key_equal(key, map->small[i].key)) {
+      return i;
+    }
+  }
+  return -1;
+}
 
-// map_find finds the value for specified key.
-// If found, the index of corresponding value will be return.
-// Else, returns the first unused index. The returned index
-// will never be invalid since our map should never be full.
-static unsigned int map_find(Map *map, Value key)
+// map_find returns the slot holding key, or -1 if there is none.
+static int map_find(Map *map, Value key, uint32_t hash)
 {
-  unsigned int idx = value_hash(key) & (map->size - 1);
-  for (;;) {
-    MapItem item = map->items[idx];
-    if (is_free(item)) {
-      return idx;
+  unsigned int group = probe_start(map, hash);
+  for (unsigned int step = 1;; step++) {
+    int8_t *ctrl = map->ctrl + group * MAP_GROUP;
+    for (GroupMask m = group_match(ctrl, h2(hash)); m; m &= m - 1) {
+      int slot = group * MAP_GROUP + __builtin_ctz(m);
+      if (key_equal(key, map->items[slot].key)) {
+        return slot;
+      }
+    }
+    if (group_empty(ctrl)) {
+      return -1;
     }
-    if (is_used(item) && value_equal(key, item.key)) {
-      return idx;
+    group = probe_next(map, group, step);
+  }
+}
+
+// find_free returns the first empty or deleted slot on the probe sequence of
+// hash.
+static int find_free(Map *map, uint32_t hash)
+{
+  unsigned int group = probe_start(map, hash);
+  for (unsigned int step = 1;; step++) {
+    GroupMask m = group_free(map->ctrl + group * MAP_GROUP);
+    if (m) {
+      return group * MAP_GROUP + __builtin_ctz(m);
     }
-    // open addressing
-    idx = (idx + 1) & (map->size - 1);
+    group = probe_next(map, group, step);
   }
 }
 
-// map_grow resizes the map's item list and rehash all the used items.
-// The new size is 2 * used.
-static void map_grow(Map *map)
+// table_insert puts an item whose key is not in the table yet.
+static void table_insert(Map *map, MapItem item)
 {
-  Map tmp;
-  _map_init(&tmp, map->size * 2);
+  uint32_t hash = key_hash(item.key);
+  int slot = find_free(map, hash);
+  if (map->ctrl[slot] == CTRL_EMPTY) {
+    map->growth_left--;
+  }
+  map->ctrl[slot] = h2(hash);
+  map->items[slot] = item;
+  map->used++;
+}
 
-  for (int i = 0; i < map->size; i++) {
-    MapItem item = map->items[i];
-    if (item.tag == ITEM_USED) {
-      map_put(&tmp, item.key, item.value);
+static void map_resize(Map *map, unsigned int size)
+{
+  Map old = *map;
+  table_init(map, size);
+  for (unsigned int i = 0; i < old.size; i++) {
+    if (old.ctrl[i] >= 0) {
+      table_insert(map, old.items[i]);
     }
   }
+  reallocate(old.items, table_bytes(old.size), 0);
+}
 
-  free_array(MapItem, map->items, map->size);
-  map->size = tmp.size;
-  map->used = tmp.used;
-  map->items = tmp.items;
+// map_promote moves the items of a small map into a table.
+static void map_promote(Map *map)
+{
+  MapItem small[MAP_SMALL];
+  memcpy(small, map->small, sizeof(small));
+  table_init(map, MAP_INIT_SIZE);
+  for (int i = 0; i < MAP_SMALL; i++) {
+    table_insert(map, small[i]);
+  }
 }
 
-#define LOAD_FACTOR_MAX (0.9)
+// map_rehash_in_place drops the deleted slots without growing the table.
+// The keys still to place are marked deleted, and each is moved to the
+// first free slot on its probe sequence, swapping with a key still to place
+// if that is where it lands.
+static void map_rehash_in_place(Map *map)
+{
+  for (unsigned int i = 0; i < map->size; i++) {
+    map->ctrl[i] = map->ctrl[i] < 0 ? CTRL_EMPTY : CTRL_DELETED;
+  }
+  for (unsigned int i = 0; i < map->size; i++) {
+    if (map->ctrl[i] != CTRL_DELETED) {
+      continue;
+    }
+    uint32_t hash = key_hash(map->items[i].key);
+    int slot = find_free(map, hash);
+    // Slot i is free itself, so the probe never goes past its group.
+    if (slot / MAP_GROUP == i / MAP_GROUP) {
+      map->ctrl[i] = h2(hash);
+      continue;
+    }
+    if (map->ctrl[slot] == CTRL_EMPTY) {
+      map->items[slot] = map->items[i];
+      map->ctrl[i] = CTRL_EMPTY;
+    } else {
+      MapItem tmp = map->items[slot];
+      map->items[slot] = map->items[i];
+      map->items[i] = tmp;
+      i--;
+    }
+    map->ctrl[slot] = h2(hash);
+  }
+  map->growth_left = capacity(map->size) - map->used;
+}
 
 // map_put puts a key-value pair to the map.
 void map_put(Map *map, Value key, Value value)
 {
-  unsigned int idx = map_find(map, key);
-  if (is_free(map->items[idx])) {
-    map->used++;
+  if (map->size == 0) {
+    int i = small_find(map, key);
+    if (i >= 0) {
+      map->small[i].value = value;
+      return;
+    }
+    if (map->used < MAP_SMALL) {
+      map->small[map->used].key = key;
+      map->small[map->used].value = value;
+      map->used++;
+      return;
+    }
+    map_promote(map);
+  }
+
+  uint32_t hash = key_hash(key);
+  int slot = map_find(map, key, hash);
+  if (slot >= 0) {
+    map->items[slot].value = value;
+    return;
   }
-  map->items[idx].tag = ITEM_USED;
-  map->items[idx].key = key;
-  map->items[idx].value = value;
 
-  // If the load factor (used / size) is greater than LOAD_FACTOR_MAX,
-  // grows the map.
-  float load_factor = (float)map->used / (float)map->size;
-  if (load_factor > LOAD_FACTOR_MAX) {
-    map_grow(map);
+  slot = find_free(map, hash);
+  if (map->ctrl[slot] == CTRL_EMPTY && map->growth_left == 0) {
+    // Out of empty slots. If deleted slots hold most of them, dropping
+    // those is enough to make room.
+    if (map->used <= capacity(map->size) / 2) {
+      map_rehash_in_place(map);
+    } else {
+      map_resize(map, map->size * 2);
+    }
+    slot = find_free(map, hash);
+  }
+  if (map->ctrl[slot] == CTRL_EMPTY) {
+    map->growth_left--;
   }
+  map->ctrl[slot] = h2(hash);
+  map->items[slot].key = key;
+  map->items[slot].value = value;
+  map->used++;
 }
 
 int map_del(Map *map, Value key)
 {
-  unsigned int idx = map_find(map, key);
-  if (is_free(map->items[idx])) {
+  if (map->size == 0) {
+    int i = small_find(map, key);
+    if (i < 0) {
+      return 0;
+    }
+    map->small[i] = map->small[--map->used];
+    return 1;
+  }
+
+  int slot = map_find(map, key, key_hash(key));
+  if (slot < 0) {
     return 0;
   }
-  map->items[idx].tag = ITEM_TOMB;
+  // No probe goes past a group which still has an empty slot, so the slot
+  // can be emptied instead of leaving a tombstone.
+  if (group_empty(map->ctrl + slot / MAP_GROUP * MAP_GROUP)) {
+    map->ctrl[slot] = CTRL_EMPTY;
+    map->growth_left++;
+  } else {
+    map->ctrl[slot] = CTRL_DELETED;
+  }
+  map->used--;
   return 1;
 }
 
 int map_get(Map *map, Value key, Value *pvalue)
 {
-  unsigned int idx = map_find(map, key);
-  MapItem item = map->items[idx];
-  if (is_free(item)) {
-    return 0;
+  MapItem *item;
+  if (map->size == 0) {
+    int i = small_find(map, key);
+    if (i < 0) {
+      return 0;
+    }
+    item = &map->small[i];
+  } else {
+    int slot = map_find(map, key, key_hash(key));
+    if (slot < 0) {
+      return 0;
+    }
+    item = &map->items[slot];
   }
   if (pvalue != NULL) {
-    *pvalue = item.value;
+    *pvalue = item->value;
   }
   return 1;
 }
 
-MapIter *map_iter_new(Map *map)
+static bool string_is(Value key, const char *str, int len, uint32_t hash)
 {
-  MapIter *iter = (MapIter *)reallocate(NULL, 0, sizeof(MapIter));
-  iter->pos = -1;
+  ObjectString *string = as_string(key);
+  return string->hash == hash && string->len == len
+         && memcmp(string->str, str, len) == 0;
+}
+
+Object *map_find_string(Map *map, const char *str, int len, uint32_t hash)
+{
+  if (map->size == 0) {
+    for (unsigned int i = 0; i < map->used; i++) {
+      if (string_is(map->small[i].key, str, len, hash)) {
+        return as_object(map->small[i].key);
+      }
+    }
+    return NULL;
+  }
+
+  unsigned int group = probe_start(map, hash);
+  for (unsigned int step = 1;; step++) {
+    int8_t *ctrl = map->ctrl + group * MAP_GROUP;
+    for (GroupMask m = group_match(ctrl, h2(hash)); m; m &= m - 1) {
+      int slot = group * MAP_GROUP + __builtin_ctz(m);
+      if (string_is(map->items[slot].key, str, len, hash)) {
+        return as_object(map->items[slot].key);
+      }
+    }
+    if (group_empty(ctrl)) {
+      return NULL;
+    }
+    group = probe_next(map, group, step);
+  }
+}
+
+void map_iter_init(MapIter *iter, Map *map)
+{
+  iter->pos = map->size == 0 ? (int)map->used : -1;
   iter->map = map;
   iter->key = value_make_nil();
   iter->val = value_make_nil();
-  return iter;
 }
 
 bool map_iter_next(MapIter *iter)
 {
-  while (++iter->pos < iter->map->size) {
-    MapItem item = iter->map->items[iter->pos];
-    if (is_used(item)) {
-      iter->key = item.key;
-      iter->val = item.value;
+  Map *map = iter->map;
+  if (map->size == 0) {
+    // Small maps are walked backwards, so deleting the current item, which
+    // moves the last one into its place, skips none.
+    if (iter->pos <= 0) {
+      return false;
+    }
+    iter->pos--;
+    iter->key = map->small[iter->pos].key;
+    iter->val = map->small[iter->pos].value;
+    return true;
+  }
+  while (++iter->pos < (int)map->size) {
+    if (map->ctrl[iter->pos] >= 0) {
+      iter->key = map->items[iter->pos].key;
+      iter->val = map->items[iter->pos].value;
       return true;
     }
   }
   return false;
 }
 
-void map_iter_close(MapIter *iter) { reallocate(iter, sizeof(MapIter), 0); }
\ No newline at end of file
+static inline void trace_value(Value value, ValueArray *wset)
+{
+  if (is_object(value)) {
+    value_array_write(wset, value);
+  }
+}
+
+void map_trace(Map *map, ValueArray *wset)
+{
+  if (map->size == 0) {
+    for (unsigned int i = 0; i < map->used; i++) {
+      trace_value(map->small[i].key, wset);
+      trace_value(map->small[i].value, wset);
+    }
+    return;
+  }
+  for (unsigned int i = 0; i < map->size; i++) {
+    if (map->ctrl[i] >= 0) {
+      trace_value(map->items[i].key, wset);
+      trace_value(map->items[i].value, wset);
+    }
+  }
+}
\ No newline at end of file
@@ -3,24 +3,48 @@
 
 #include "value.h"
 
+// Map is an open addressing hash table in the style of a Swiss table. The
+// slots are split into groups of MAP_GROUP, and every slot has a control
+// byte telling whether it is empty, deleted, or holds a key with the given
+// low 7 bits of hash. A lookup matches the control bytes of a whole group at
+// once and only compares the keys whose bits match.
+//
+// Most maps hold a few methods or fields, so a map starts small: up to
+// MAP_SMALL items are kept inline and searched linearly, and the table is
+// only allocated when one more is put.
+#define MAP_GROUP 16
+#define MAP_SMALL 4
+
 typedef struct {
-  uint8_t tag;
   Value key;
   Value value;
 } MapItem;
 
 typedef struct {
-  unsigned int size;
-  unsigned int used;
+  unsigned int size;        // slots of the table, 0 while the map is small
+  unsigned int used;        // items in the map
+  unsigned int growth_left; // empty slots to fill before a rehash
 
-  MapItem *items;
+  union {
+    MapItem small[MAP_SMALL];
+    struct {
+      int8_t *ctrl;
+      MapItem *items;
+    };
+  };
 } Map;
 
 void map_init(Map *);
+void map_free(Map *);
 void map_put(Map *, Value, Value);
 int map_del(Map *, Value);
 int map_get(Map *, Value, Value *);
 
+// map_find_string looks up a string key by its content and returns it, or
+// NULL if the map has no such key. Unlike map_get it needs no string object
+// to search with.
+Object *map_find_string(Map *, const char *, int, uint32_t);
+
 typedef struct {
   Map *map;
   int pos;
@@ -28,8 +52,14 @@ typedef struct {
   Value val;
 } MapIter;
 
-MapIter *map_iter_new(Map *);
+// MapIter walks the items of a map. It is meant to live on the stack: set it
+// up with map_iter_init and call map_iter_next until it returns false. The
+// current item may be deleted while walking.
+void map_iter_init(MapIter *, Map *);
 bool map_iter_next(MapIter *);
-void map_iter_close(MapIter *);
+
+// map_trace writes the keys and values of the map which are objects into
+// wset. The collector uses it instead of an iterator.
+void map_trace(Map *, ValueArray *wset);
 
 #endif
\ No newline at end of file
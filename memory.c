@@ -13,4 +13,10 @@ void *reallocate(void *ptr, int oldSize, int newSize)
   return realloc(ptr, newSize);
 }
 
+void *allocate_aligned(int align, int size)
+{
+  alloc_size += size;
+  return aligned_alloc(align, size);
+}
+
 unsigned int mem_alloc() { return alloc_size; }
@@ -9,6 +9,10 @@
 #define free_array(type, ptr, size) (reallocate(ptr, sizeof(type) * (size), 0))
 
 void *reallocate(void *ptr, int oldSize, int newSize);
+
+// allocate_aligned allocates size bytes aligned to align, a power of two
+// dividing size. The memory is freed with reallocate.
+void *allocate_aligned(int align, int size);
 unsigned int mem_alloc(void);
 
 #endif
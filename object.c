@@ -5,50 +5,154 @@
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
-
-void none_destructor(Object *obj) { return; }
+#include "shape.h"
 
 void string_format(Object *obj) { printf("%s", ((ObjectString *)obj)->str); }
 
+// strings interns every string object, so strings with equal content are
+// the same object and compare by pointer. The table does not keep its
+// strings alive: string_destructor removes a string when it is freed, and
+// string_sweep the strings a full collection is about to free.
+static Map strings;
+static bool strings_ready = false;
+
+static Map *string_table(void)
+{
+  if (!strings_ready) {
+    map_init(&strings);
+    strings_ready = true;
+  }
+  return &strings;
+}
+
+static Object *string_find(const char *src, int len, uint32_t hash)
+{
+  return map_find_string(string_table(), src, len, hash);
+}
+
+static void string_intern(Object *obj)
+{
+  map_put(string_table(), value_make_object(obj), value_make_nil());
+}
+
+void string_sweep(void)
+{
+  Map *table = string_table();
+  MapIter iter;
+  map_iter_init(&iter, table);
+  while (map_iter_next(&iter)) {
+    if (!heap_marked(as_object(iter.key))) {
+      map_del(table, iter.key);
+    }
+  }
+}
+
 void string_destructor(Object *obj)
 {
   ObjectString *string = (ObjectString *)obj;
+  map_del(string_table(), value_make_object(obj));
   if (string->str != string->raw) {
     reallocate(string->str, string->len + 1, 0);
   }
 }
 
+// selectors maps every method name met so far to its selector, and
+// selector_names the selectors back to names.
+static Map selectors;
+static ValueArray selector_names;
+static bool selectors_ready = false;
+
+static Map *selector_table(void)
+{
+  if (!selectors_ready) {
+    map_init(&selectors);
+    value_array_init(&selector_names);
+    selectors_ready = true;
+    selector_of((ObjectString *)string_copy("init", 4));
+  }
+  return &selectors;
+}
+
+int selector_of(ObjectString *name)
+{
+  int selector = selector_find(name);
+  if (selector >= 0) {
+    return selector;
+  }
+  selector = selector_names.len;
+  map_put(&selectors, value_make_object((Object *)name),
+          value_make_number(selector));
+  value_array_write(&selector_names, value_make_object((Object *)name));
+  return selector;
+}
+
+int selector_find(ObjectString *name)
+{
+  Value selector;
+  if (!map_get(selector_table(), value_make_object((Object *)name),
+               &selector)) {
+    return -1;
+  }
+  return (int)as_number(selector);
+}
+
+ObjectString *selector_name(int selector)
+{
+  return as_string(selector_names.value[selector]);
+}
+
+int selector_count(void)
+{
+  selector_table();
+  return selector_names.len;
+}
+
 Object *string_copy(char *src, int len)
 {
   ObjectString *obj;
   uint32_t hash;
 
+  hash = FNV1a_hash(src, len);
+  Object *interned = string_find(src, len, hash);
+  if (interned != NULL) {
+    return interned;
+  }
+
   // We need one more byte for trailing \0
   size_t size = sizeof(*obj) + len + 1;
-  hash = FNV1a_hash(src, len);
-  obj = (ObjectString *)object_alloc(size, OBJ_STRING, hash, string_equal,
-                                     string_format, string_destructor);
+  obj = (ObjectString *)object_alloc(size, OBJ_STRING);
+  obj->hash = hash;
 
   memcpy(obj->raw, src, len);
   obj->raw[len] = '\0';
 
   obj->len = len;
   obj->str = obj->raw;
+  string_intern((Object *)obj);
   return (Object *)obj;
 }
 
+// string_take creates a string object owning src, which must have been
+// allocated with reallocate and hold len + 1 bytes. If the string is already
+// interned, src is freed and the interned object is returned.
 Object *string_take(char *src, int len)
 {
   ObjectString *obj;
   uint32_t hash;
 
   hash = FNV1a_hash(src, len);
-  obj = (ObjectString *)object_alloc(sizeof(ObjectString), OBJ_STRING, hash,
-                                     string_equal, string_format,
-                                     none_destructor);
+  Object *interned = string_find(src, len, hash);
+  if (interned != NULL) {
+    reallocate(src, len + 1, 0);
+    return interned;
+  }
+
+  obj = (ObjectString *)object_alloc(sizeof(ObjectString), OBJ_STRING);
+  obj->hash = hash;
 
   obj->len = len;
   obj->str = src;
+  string_intern((Object *)obj);
   return (Object *)obj;
 }
 
@@ -60,19 +164,16 @@ Object *string_concat(ObjectString *obj1, ObjectString *obj2)
 
   len = obj1->len + obj2->len;
   dst = (char *)reallocate(NULL, 0, len + 1);
-  strcpy(dst, obj1->str);
-  strcpy(dst + obj1->len, obj2->str);
+  memcpy(dst, obj1->str, obj1->len);
+  memcpy(dst + obj1->len, obj2->str, obj2->len);
+  dst[len] = '\0';
 
   obj = string_take(dst, len);
   return obj;
 }
 
-bool string_equal(Object *s1, Object *s2)
-{
-  if (s1 == s2)
-    return true;
-  return strcmp(((ObjectString *)s1)->str, ((ObjectString *)s2)->str) == 0;
-}
+// Strings are interned, so equal strings are the same object.
+bool string_equal(Object *s1, Object *s2) { return s1 == s2; }
 
 void function_format(Object *f)
 {
@@ -85,24 +186,44 @@ bool function_equal(Object *f1, Object *f2) { return f1 == f2; }
 
 void function_destructor(Object *obj)
 {
-  chunk_free(&((ObjectFunction *)obj)->chunk);
+  ObjectFunction *fun = (ObjectFunction *)obj;
+  chunk_free(&fun->chunk);
+  value_array_free(&fun->constants);
+  free_array(InlineCache, fun->ics, fun->ic_size);
 }
 
 Object *fun_new(int arity, ObjectString *name)
 {
   ObjectFunction *obj;
 
-  obj = (ObjectFunction *)object_alloc(sizeof(ObjectFunction), OBJ_FUNCTION,
-                                       name->base.hash, function_equal,
-                                       function_format, function_destructor);
+  obj = (ObjectFunction *)object_alloc(sizeof(ObjectFunction), OBJ_FUNCTION);
 
   obj->arity = arity;
   obj->name = name;
+  obj->ics = NULL;
+  obj->ic_size = 0;
+  obj->upvalue_size = 0;
+  obj->slot_size = 0;
+  obj->stack_size = 0;
+  obj->profile_count = 0;
+  obj->verified = false;
   chunk_init(&obj->chunk);
+  value_array_init(&obj->constants);
 
   return (Object *)obj;
 }
 
+// fun_init_ics gives the function size empty inline caches.
+void fun_init_ics(ObjectFunction *fun, int size)
+{
+  fun->ics = grow_array(InlineCache, fun->ics, fun->ic_size, size);
+  fun->ic_size = size;
+  for (int i = 0; i < size; i++) {
+    fun->ics[i].len = 0;
+    fun->ics[i].megamorphic = false;
+  }
+}
+
 void upvalue_format(Object *upvalue)
 {
   printf("<upvalue %p>", ((ObjectUpValue *)upvalue)->location);
@@ -111,9 +232,7 @@ void upvalue_format(Object *upvalue)
 ObjectUpValue *upvalue_new(Value *location)
 {
   ObjectUpValue *up;
-  up = (ObjectUpValue *)object_alloc(sizeof(ObjectUpValue), OBJ_UPVALUE, nohash,
-                                     NULL /* equal_fn */, upvalue_format,
-                                     none_destructor);
+  up = (ObjectUpValue *)object_alloc(sizeof(ObjectUpValue), OBJ_UPVALUE);
 
   up->location = location;
   up->closed = value_make_nil();
@@ -125,6 +244,7 @@ void upvalue_close(ObjectUpValue *to_close)
 {
   to_close->closed = *to_close->location;
   to_close->location = &to_close->closed;
+  write_barrier((Object *)to_close, to_close->closed);
 }
 
 void closure_format(Object *c)
@@ -146,9 +266,7 @@ bool closure_equal(Object *c1, Object *c2) { return c1 == c2; }
 ObjectClosure *closure_new(ObjectFunction *proto)
 {
   ObjectClosure *closure;
-  closure = (ObjectClosure *)object_alloc(sizeof(ObjectClosure), OBJ_CLOSURE,
-                                          proto->base.hash, closure_equal,
-                                          closure_format, closure_destructor);
+  closure = (ObjectClosure *)object_alloc(sizeof(ObjectClosure), OBJ_CLOSURE);
 
   closure->proto = proto;
   closure->upvalue_size = proto->upvalue_size;
@@ -166,9 +284,7 @@ void native_format(Object *native) { printf("<native fn>"); }
 ObjectNative *native_new(int arity, native_fn method)
 {
   ObjectNative *obj;
-  obj = (ObjectNative *)object_alloc(sizeof(ObjectNative), OBJ_NATIVE, nohash,
-                                     NULL /* equal_fn */, native_format,
-                                     none_destructor);
+  obj = (ObjectNative *)object_alloc(sizeof(ObjectNative), OBJ_NATIVE);
   obj->arity = arity;
   obj->method = method;
   return obj;
@@ -181,14 +297,26 @@ Value native_clock(int arity, Value *argv)
 
 void class_format(Object *klass) { object_print(((ObjectClass *)klass)->name); }
 
+void class_destructor(Object *obj)
+{
+  ObjectClass *klass = (ObjectClass *)obj;
+  free_array(ObjectClosure *, klass->methods, klass->method_cap);
+  shape_free(klass->shape);
+  shape_free(klass->dictionary);
+}
+
 ObjectClass *class_new(ObjectString *name)
 {
   ObjectClass *klass;
-  klass = (ObjectClass *)object_alloc(sizeof(ObjectClass), OBJ_CLASS, nohash,
-                                      NULL, class_format, none_destructor);
+  klass = (ObjectClass *)object_alloc(sizeof(ObjectClass), OBJ_CLASS);
 
   klass->name = name;
-  map_init(&klass->methods);
+  klass->methods = NULL;
+  klass->method_size = 0;
+  klass->method_cap = 0;
+  klass->shape = shape_new_root(klass);
+  klass->dictionary = shape_new_dictionary(klass);
+  klass->inline_size = 0;
   return klass;
 }
 
@@ -199,18 +327,160 @@ void instance_format(Object *obj)
   printf(" instance");
 }
 
+void instance_destructor(Object *obj)
+{
+  ObjectInstance *ins = (ObjectInstance *)obj;
+  free_array(Value, ins->overflow, ins->overflow_cap);
+  if (ins->dict != NULL) {
+    map_free(ins->dict);
+    reallocate(ins->dict, sizeof(Map), 0);
+  }
+}
+
 ObjectInstance *instance_new(ObjectClass *klass)
 {
+  int size = sizeof(ObjectInstance) + sizeof(Value) * klass->inline_size;
   ObjectInstance *ins;
-  ins = (ObjectInstance *)object_alloc(sizeof(ObjectInstance), OBJ_INSTANCE,
-                                       nohash, NULL, instance_format,
-                                       none_destructor);
+  ins = (ObjectInstance *)object_alloc(size, OBJ_INSTANCE);
 
   ins->klass = klass;
-  map_init(&ins->fields);
+  ins->shape = klass->shape;
+  ins->inline_size = klass->inline_size;
+  ins->overflow_cap = 0;
+  ins->overflow = NULL;
+  ins->dict = NULL;
   return ins;
 }
 
+// class_reserve makes room for methods up to selector in the method table.
+static void class_reserve(ObjectClass *klass, int selector)
+{
+  if (selector < klass->method_size) {
+    return;
+  }
+  if (selector >= klass->method_cap) {
+    int cap = grow_cap(klass->method_cap);
+    while (cap <= selector) {
+      cap *= 2;
+    }
+    klass->methods = grow_array(ObjectClosure *, klass->methods,
+                                klass->method_cap, cap);
+    klass->method_cap = cap;
+  }
+  for (int i = klass->method_size; i <= selector; i++) {
+    klass->methods[i] = NULL;
+  }
+  klass->method_size = selector + 1;
+}
+
+void class_add_method(ObjectClass *klass, int selector, ObjectClosure *method)
+{
+  class_reserve(klass, selector);
+  klass->methods[selector] = method;
+  write_barrier((Object *)klass, value_make_object((Object *)method));
+}
+
+void class_inherit(ObjectClass *klass, ObjectClass *super)
+{
+  if (super->method_size == 0) {
+    return;
+  }
+  class_reserve(klass, super->method_size - 1);
+  for (int i = 0; i < super->method_size; i++) {
+    if (super->methods[i] != NULL) {
+      klass->methods[i] = super->methods[i];
+      write_barrier((Object *)klass,
+                    value_make_object((Object *)super->methods[i]));
+    }
+  }
+}
+
+void class_seal(ObjectClass *klass)
+{
+  klass->methods = grow_array(ObjectClosure *, klass->methods,
+                              klass->method_cap, klass->method_size);
+  klass->method_cap = klass->method_size;
+}
+
+bool instance_get(ObjectInstance *ins, ObjectString *name, Value *pvalue)
+{
+  if (ins->shape->dictionary) {
+    return map_get(ins->dict, value_make_object((Object *)name), pvalue);
+  }
+  int slot = shape_find(ins->shape, name);
+  if (slot < 0) {
+    return false;
+  }
+  *pvalue = *instance_field(ins, slot);
+  return true;
+}
+
+// instance_to_dictionary moves the fields of the instance into a dictionary.
+static void instance_to_dictionary(ObjectInstance *ins)
+{
+  Map *dict = (Map *)reallocate(NULL, 0, sizeof(Map));
+  map_init(dict);
+  Shape *shape = ins->shape;
+  for (int i = 0; i < shape->size; i++) {
+    map_put(dict, value_make_object((Object *)shape->names[i]),
+            *instance_field(ins, i));
+    write_barrier((Object *)ins, *instance_field(ins, i));
+  }
+  free_array(Value, ins->overflow, ins->overflow_cap);
+  ins->overflow = NULL;
+  ins->overflow_cap = 0;
+  ins->dict = dict;
+  ins->shape = ins->klass->dictionary;
+}
+
+void instance_set(ObjectInstance *ins, ObjectString *name, Value value)
+{
+  if (!ins->shape->dictionary) {
+    int slot = shape_find(ins->shape, name);
+    if (slot >= 0) {
+      *instance_field(ins, slot) = value;
+      write_barrier((Object *)ins, value);
+      return;
+    }
+    if (ins->shape->size < SHAPE_MAX_FIELDS) {
+      instance_add(ins, shape_add(ins->shape, name), value);
+      return;
+    }
+    instance_to_dictionary(ins);
+  }
+  map_put(ins->dict, value_make_object((Object *)name), value);
+  write_barrier((Object *)ins, value);
+  write_barrier((Object *)ins, value_make_object((Object *)name));
+}
+
+// instance_add stores value as the new field of shape, a child of the
+// instance's shape.
+void instance_add(ObjectInstance *ins, Shape *shape, Value value)
+{
+  int slot = ins->shape->size;
+  ins->shape = shape;
+  if (slot >= ins->inline_size) {
+    int overflow_size = slot - ins->inline_size;
+    if (overflow_size == ins->overflow_cap) {
+      int cap = grow_cap(ins->overflow_cap);
+      ins->overflow = grow_array(Value, ins->overflow, ins->overflow_cap, cap);
+      ins->overflow_cap = cap;
+    }
+  }
+  *instance_field(ins, slot) = value;
+  write_barrier((Object *)ins, value);
+
+  // The class keeps the names of its shapes alive.
+  write_barrier((Object *)ins->klass,
+                value_make_object((Object *)shape->names[slot]));
+
+  // Later instances of the class reserve room for as many fields inline.
+  ObjectClass *klass = ins->klass;
+  if (shape->size > klass->inline_size && shape->size <= INSTANCE_INLINE_MAX) {
+    klass->inline_size = shape->size;
+  }
+}
+
 void bound_method_format(Object *obj)
 {
   ObjectBoundMethod *bm = (ObjectBoundMethod *)obj;
@@ -221,28 +491,32 @@ ObjectBoundMethod *bound_method_new(ObjectClosure *method, ObjectInstance *ins)
 {
   ObjectBoundMethod *bm;
   bm = (ObjectBoundMethod *)object_alloc(sizeof(ObjectBoundMethod),
-                                         OBJ_BOUND_METHOD, nohash, NULL,
-                                         bound_method_format, none_destructor);
+                                         OBJ_BOUND_METHOD);
 
   bm->method = method;
   bm->receiver = ins;
   return bm;
 }
 
+const ObjectVtable object_vtables[] = {
+  [OBJ_STRING] = { string_equal, string_format, string_destructor },
+  [OBJ_FUNCTION] = { function_equal, function_format, function_destructor },
+  [OBJ_UPVALUE] = { NULL, upvalue_format, NULL },
+  [OBJ_CLOSURE] = { closure_equal, closure_format, closure_destructor },
+  [OBJ_NATIVE] = { NULL, native_format, NULL },
+  [OBJ_CLASS] = { NULL, class_format, class_destructor },
+  [OBJ_INSTANCE] = { NULL, instance_format, instance_destructor },
+  [OBJ_BOUND_METHOD] = { NULL, bound_method_format, NULL },
+};
+
 Value value_make_string(char *str, int len)
 {
-  Value value;
-  value.type = VT_OBJ;
-  value.as.obj = string_copy(str, len);
-  return value;
+  return value_make_object(string_copy(str, len));
 }
 
 Value value_make_fun(int arity, ObjectString *name)
 {
-  Value value;
-  value.type = VT_OBJ;
-  value.as.obj = fun_new(arity, name);
-  return value;
+  return value_make_object(fun_new(arity, name));
 }
 
 Value value_make_closure(ObjectFunction *proto)
@@ -252,8 +526,5 @@ Value value_make_closure(ObjectFunction *proto)
 
 Value value_make_native(int arity, native_fn method)
 {
-  Value value;
-  value.type = VT_OBJ;
-  value.as.obj = (Object *)native_new(arity, method);
-  return value;
+  return value_make_object((Object *)native_new(arity, method));
 }
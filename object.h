@@ -13,6 +13,7 @@
 // raw, else str may point to other space specified by user.
 typedef struct {
   Object base;
+  uint32_t hash;
   int len;
   char *str;
   char raw[];
@@ -24,7 +25,48 @@ Object *string_take(char *, int);
 Object *string_concat(ObjectString *, ObjectString *);
 bool string_equal(Object *, Object *);
 
-#define nohash 0
+// string_sweep removes the strings not marked by a full collection from the
+// intern table. It must run once marking is done, since the old strings are
+// only freed as the sweep reaches them.
+void string_sweep(void);
+
+// Method names are numbered by selector_of the first time it meets them, so
+// that classes keep their methods in tables indexed by selector. The names
+// stay alive for good: the vm marks them as roots.
+#define SELECTOR_INIT 0 // "init"
+#define SELECTOR_MAX (UINT16_MAX + 1)
+
+int selector_of(ObjectString *);
+
+// selector_find returns the selector of a name, or -1 if it is none.
+int selector_find(ObjectString *);
+
+ObjectString *selector_name(int);
+int selector_count(void);
+
+// InlineCache caches the result of a property lookup at one OP_GET_FIELD,
+// OP_SET_FIELD or OP_INVOKE site, keyed on the shape of the receiver. A site
+// starts monomorphic, turns polymorphic as it meets more shapes, and is
+// marked megamorphic, after which the cache is no longer consulted, once it
+// has seen more than IC_WAYS shapes.
+#define IC_WAYS 4
+
+typedef struct {
+  struct Shape *shape;
+  // slot is the field's slot in the receiver, or -1 if the property resolved
+  // to the method below.
+  int slot;
+  // next is the shape an OP_SET_FIELD moves the receiver to when it adds the
+  // field, or NULL if the field already exists.
+  struct Shape *next;
+  Value method;
+} ICEntry;
+
+typedef struct {
+  uint8_t len;
+  bool megamorphic;
+  ICEntry entries[IC_WAYS];
+} InlineCache;
 
 // ObjectFunction represents a function object in clox.
 typedef struct {
@@ -32,12 +74,26 @@ typedef struct {
   ObjectString *name;
   int arity;
   Chunk chunk;
+  // constants is the constant pool of chunk
+  ValueArray constants;
+  // ics holds one inline cache per property access site in chunk
+  InlineCache *ics;
+  int ic_size;
   int upvalue_size;
+  // slot_size is the number of local slots the function addresses
+  int slot_size;
+  // stack_size is the deepest the stack of a frame running the function can
+  // get, found by the verifier
+  int stack_size;
+  // profile_count is the number of instructions executed in the function
+  // while profiling
+  uint64_t profile_count;
+  // verified is set once the chunk has passed the bytecode verifier
+  bool verified;
 } ObjectFunction;
 
 Object *fun_new(int, ObjectString *);
-
-typedef struct Value Value;
+void fun_init_ics(ObjectFunction *, int);
 
 typedef struct ObjectUpvalue {
   Object base;
@@ -72,18 +128,61 @@ Value native_clock(int, Value *);
 typedef struct ObjectClass {
   Object base;
   ObjectString *name;
-  Map methods;
+  // methods holds every method of the class, inherited ones included, at
+  // the index of its selector, and NULL where the class has none. The
+  // methods of the superclass are copied down when the class derives from
+  // it, and the table is trimmed once the class body is done.
+  ObjectClosure **methods;
+  int method_size;
+  int method_cap;
+  // shape is the root of the shape tree of the class's instances, and
+  // dictionary the shape of those with too many fields for it
+  struct Shape *shape;
+  struct Shape *dictionary;
+  // inline_size is the number of fields new instances reserve inline, the
+  // most any instance has had so far up to INSTANCE_INLINE_MAX
+  int inline_size;
 } ObjectClass;
 
 ObjectClass *class_new(ObjectString *);
+void class_add_method(ObjectClass *, int selector, ObjectClosure *);
+void class_inherit(ObjectClass *, ObjectClass *super);
+void class_seal(ObjectClass *);
+
+static inline ObjectClosure *class_method(ObjectClass *klass, int selector)
+{
+  return selector < klass->method_size ? klass->methods[selector] : NULL;
+}
+
+#define INSTANCE_INLINE_MAX 8
 
+// ObjectInstance stores field slot i of its shape in fields[i] for the first
+// inline_size slots and in overflow after that. Instances with a dictionary
+// shape keep their fields in dict instead.
 typedef struct {
   Object base;
   ObjectClass *klass;
-  Map fields;
+  struct Shape *shape;
+  int inline_size;
+  int overflow_cap;
+  Value *overflow;
+  Map *dict;
+  Value fields[];
 } ObjectInstance;
 
 ObjectInstance *instance_new(ObjectClass *);
+bool instance_get(ObjectInstance *, ObjectString *, Value *);
+void instance_set(ObjectInstance *, ObjectString *, Value);
+void instance_add(ObjectInstance *, struct Shape *, Value);
+
+// instance_field returns the storage of the instance's field at slot.
+static inline Value *instance_field(ObjectInstance *ins, int slot)
+{
+  if (slot < ins->inline_size) {
+    return &ins->fields[slot];
+  }
+  return &ins->overflow[slot - ins->inline_size];
+}
 
 typedef struct {
   Object base;
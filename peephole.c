@@ -0,0 +1,402 @@
+#include "peephole.h"
+#include "memory.h"
+
+// instruction_size returns the length in bytes of the instruction at offset.
+static int instruction_size(ObjectFunction *fun, int offset)
+{
+  Chunk *chunk = &fun->chunk;
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_SET_LOCAL:
+  case OP_GET_LOCAL:
+  case OP_SET_UPVALUE:
+  case OP_GET_UPVALUE:
+  case OP_CALL:
+  case OP_ADD_CONST:
+  case OP_SET_LOCAL_POP:
+    return 2;
+
+  case OP_ADD_LL:
+  case OP_ADD_LC:
+  case OP_MINUS_LL:
+  case OP_MINUS_LC:
+  case OP_MUL_LL:
+  case OP_MUL_LC:
+  case OP_DIV_LL:
+  case OP_DIV_LC:
+  case OP_MOVE:
+  case OP_LOAD_CONST:
+    return 3;
+
+  case OP_ADD_LL_TO:
+  case OP_ADD_LC_TO:
+  case OP_MINUS_LL_TO:
+  case OP_MINUS_LC_TO:
+  case OP_MUL_LL_TO:
+  case OP_MUL_LC_TO:
+  case OP_DIV_LL_TO:
+  case OP_DIV_LC_TO:
+    return 4;
+
+  case OP_CONSTANT_LONG:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_JMP:
+  case OP_JMP_BACK:
+  case OP_JMP_ON_FALSE:
+  case OP_JMP_UNLESS_EQUAL:
+  case OP_JMP_UNLESS_GREATER:
+  case OP_JMP_UNLESS_GREATER_EQUAL:
+  case OP_JMP_UNLESS_LESS:
+  case OP_JMP_UNLESS_LESS_EQUAL:
+    return 3;
+
+  case OP_GET_FIELD:
+  case OP_SET_FIELD:
+  case OP_JMP_UNLESS_EQUAL_LL:
+  case OP_JMP_UNLESS_EQUAL_LC:
+  case OP_JMP_UNLESS_GREATER_LL:
+  case OP_JMP_UNLESS_GREATER_LC:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LL:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LC:
+  case OP_JMP_UNLESS_LESS_LL:
+  case OP_JMP_UNLESS_LESS_LC:
+  case OP_JMP_UNLESS_LESS_EQUAL_LL:
+  case OP_JMP_UNLESS_LESS_EQUAL_LC:
+    return 5;
+
+  case OP_INVOKE:
+  case OP_GET_LOCAL_GET_FIELD:
+    return 6;
+
+  case OP_CLOSURE: {
+    int idx = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return 3 + as_function(fun->constants.value[idx])->upvalue_size * 2;
+  }
+
+  default:
+    return 1;
+  }
+}
+
+static bool is_jmp(uint8_t op)
+{
+  switch (op) {
+  case OP_JMP:
+  case OP_JMP_BACK:
+  case OP_JMP_ON_FALSE:
+  case OP_JMP_UNLESS_EQUAL:
+  case OP_JMP_UNLESS_GREATER:
+  case OP_JMP_UNLESS_GREATER_EQUAL:
+  case OP_JMP_UNLESS_LESS:
+  case OP_JMP_UNLESS_LESS_EQUAL:
+  case OP_JMP_UNLESS_EQUAL_LL:
+  case OP_JMP_UNLESS_EQUAL_LC:
+  case OP_JMP_UNLESS_GREATER_LL:
+  case OP_JMP_UNLESS_GREATER_LC:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LL:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LC:
+  case OP_JMP_UNLESS_LESS_LL:
+  case OP_JMP_UNLESS_LESS_LC:
+  case OP_JMP_UNLESS_LESS_EQUAL_LL:
+  case OP_JMP_UNLESS_LESS_EQUAL_LC:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// jmp_target returns the target of the jump at offset, which is size bytes
+// long and ends with the distance.
+static int jmp_target(Chunk *chunk, int offset, int size)
+{
+  int end = offset + size;
+  int dist = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+  if (chunk->code[offset] == OP_JMP_BACK) {
+    return end - dist;
+  }
+  return end + dist;
+}
+
+// compare_jmp returns the fused compare-and-jump for a compare opcode, or
+// OP_NONE if there is none.
+static uint8_t compare_jmp(uint8_t op)
+{
+  switch (op) {
+  case OP_EQUAL_EQUAL:
+    return OP_JMP_UNLESS_EQUAL;
+  case OP_GREATER:
+    return OP_JMP_UNLESS_GREATER;
+  case OP_GREATER_EQUAL:
+    return OP_JMP_UNLESS_GREATER_EQUAL;
+  case OP_LESS:
+    return OP_JMP_UNLESS_LESS;
+  case OP_LESS_EQUAL:
+    return OP_JMP_UNLESS_LESS_EQUAL;
+  default:
+    return OP_NONE;
+  }
+}
+
+typedef struct {
+  Chunk *chunk;
+  int *sizes;      // size of the instruction starting at each offset, else 0
+  bool *targets;   // whether some jump lands on each offset
+} Code;
+
+// next returns the offset of the instruction after the one at offset if it
+// exists and no jump lands on it, else -1. Only such an instruction may be
+// fused into the one before.
+static int next(Code *code, int offset)
+{
+  int after = offset + code->sizes[offset];
+  if (after >= code->chunk->len || code->targets[after]) {
+    return -1;
+  }
+  return after;
+}
+
+static bool next_is(Code *code, int offset, uint8_t op)
+{
+  int after = next(code, offset);
+  return after >= 0 && code->chunk->code[after] == op;
+}
+
+// register_arith returns the first register form of an arithmetic opcode,
+// or OP_NONE if it has none.
+static uint8_t register_arith(uint8_t op)
+{
+  switch (op) {
+  case OP_ADD:
+    return OP_ADD_LL;
+  case OP_MINUS:
+    return OP_MINUS_LL;
+  case OP_MUL:
+    return OP_MUL_LL;
+  case OP_DIV:
+    return OP_DIV_LL;
+  default:
+    return OP_NONE;
+  }
+}
+
+// register_compare returns the register form, with a local as the second
+// operand, of the fused compare-and-jump for a compare opcode, or OP_NONE if
+// there is none.
+static uint8_t register_compare(uint8_t op)
+{
+  switch (op) {
+  case OP_EQUAL_EQUAL:
+    return OP_JMP_UNLESS_EQUAL_LL;
+  case OP_GREATER:
+    return OP_JMP_UNLESS_GREATER_LL;
+  case OP_GREATER_EQUAL:
+    return OP_JMP_UNLESS_GREATER_EQUAL_LL;
+  case OP_LESS:
+    return OP_JMP_UNLESS_LESS_LL;
+  case OP_LESS_EQUAL:
+    return OP_JMP_UNLESS_LESS_EQUAL_LL;
+  default:
+    return OP_NONE;
+  }
+}
+
+// next_stores returns whether the instruction after the one at offset
+// stores the top of the stack in a local and pops it.
+static bool next_stores(Code *code, int offset)
+{
+  int after = next(code, offset);
+  return after >= 0 && code->chunk->code[after] == OP_SET_LOCAL
+         && next_is(code, after, OP_POP);
+}
+
+typedef struct {
+  int offset; // offset of the distance of the jump in the new chunk
+  int target; // target of the jump in the old chunk
+  bool back;  // whether it is a JMP_BACK
+} Fixup;
+
+void peephole(ObjectFunction *fun, bool registers)
+{
+  Chunk *chunk = &fun->chunk;
+  int len = chunk->len;
+
+  Code code;
+  code.chunk = chunk;
+  code.sizes = grow_array(int, NULL, 0, len);
+  code.targets = grow_array(bool, NULL, 0, len + 1);
+  for (int i = 0; i < len; i++) {
+    code.sizes[i] = 0;
+    code.targets[i] = false;
+  }
+  code.targets[len] = false;
+
+  int jmp_count = 0;
+  for (int offset = 0; offset < len; offset += code.sizes[offset]) {
+    code.sizes[offset] = instruction_size(fun, offset);
+    if (is_jmp(chunk->code[offset])) {
+      code.targets[jmp_target(chunk, offset, code.sizes[offset])] = true;
+      jmp_count++;
+    }
+  }
+
+  // new offsets of the old instructions, one past the end included
+  int *remap = grow_array(int, NULL, 0, len + 1);
+  Fixup *fixups = grow_array(Fixup, NULL, 0, jmp_count);
+  int fixup_count = 0;
+
+  Chunk out;
+  chunk_init(&out);
+
+  int offset = 0;
+  while (offset < len) {
+    uint8_t *ip = &chunk->code[offset];
+    int line = chunk_line(chunk, offset);
+    int size = code.sizes[offset];
+    remap[offset] = out.len;
+
+    if (registers && (ip[0] == OP_GET_LOCAL || ip[0] == OP_CONSTANT)) {
+      int second = next(&code, offset);
+      int third = second >= 0 ? next(&code, second) : -1;
+      uint8_t kind = second >= 0 ? chunk->code[second] : OP_NONE;
+      uint8_t op = third >= 0 ? chunk->code[third] : OP_NONE;
+      int op_line = third >= 0 ? chunk_line(chunk, third) : line;
+
+      if (kind == OP_SET_LOCAL && next_is(&code, second, OP_POP)) {
+        remap[second] = out.len;
+        remap[second + 2] = out.len;
+        chunk_add(&out, ip[0] == OP_GET_LOCAL ? OP_MOVE : OP_LOAD_CONST, line);
+        chunk_add(&out, chunk->code[second + 1], line);
+        chunk_add(&out, ip[1], line);
+        offset = second + 3;
+        continue;
+      }
+
+      // The first operand of the other forms is a local.
+      bool operands = ip[0] == OP_GET_LOCAL
+                      && (kind == OP_GET_LOCAL || kind == OP_CONSTANT);
+      uint8_t form = kind == OP_CONSTANT ? 1 : 0;
+
+      if (operands && register_arith(op) != OP_NONE) {
+        // Operand errors are reported on the line of the operator.
+        remap[second] = out.len;
+        remap[third] = out.len;
+        int end = third + 1;
+        if (next_stores(&code, third)) {
+          remap[third + 1] = out.len;
+          remap[third + 3] = out.len;
+          chunk_add(&out, register_arith(op) + form + 2, op_line);
+          chunk_add(&out, chunk->code[third + 2], op_line);
+          end = third + 4;
+        } else {
+          chunk_add(&out, register_arith(op) + form, op_line);
+        }
+        chunk_add(&out, ip[1], op_line);
+        chunk_add(&out, chunk->code[second + 1], op_line);
+        offset = end;
+        continue;
+      }
+
+      if (operands && register_compare(op) != OP_NONE
+          && next_is(&code, third, OP_JMP_ON_FALSE)
+          && next_is(&code, third + 1, OP_POP)) {
+        // As for the stack form below.
+        int target = jmp_target(chunk, third + 1, 3);
+        if (target < len && chunk->code[target] == OP_POP) {
+          remap[second] = out.len;
+          remap[third] = out.len;
+          remap[third + 1] = out.len;
+          remap[third + 4] = out.len;
+          chunk_add(&out, register_compare(op) + form, op_line);
+          chunk_add(&out, ip[1], op_line);
+          chunk_add(&out, chunk->code[second + 1], op_line);
+          fixups[fixup_count++] = (Fixup){ out.len, target + 1, false };
+          chunk_add(&out, 0, op_line);
+          chunk_add(&out, 0, op_line);
+          offset = third + 5;
+          continue;
+        }
+      }
+    }
+
+    if (compare_jmp(ip[0]) != OP_NONE && next_is(&code, offset, OP_JMP_ON_FALSE)
+        && next_is(&code, offset + 1, OP_POP)) {
+      // The condition is popped on both paths, so the fused jump lands
+      // after the POP at the target and falls through past the other one.
+      int target = jmp_target(chunk, offset + 1, 3);
+      if (target < len && chunk->code[target] == OP_POP) {
+        remap[offset + 1] = out.len;
+        remap[offset + 4] = out.len;
+        fixups[fixup_count++] = (Fixup){ out.len + 1, target + 1, false };
+        chunk_add(&out, compare_jmp(ip[0]), line);
+        chunk_add(&out, 0, line);
+        chunk_add(&out, 0, line);
+        offset += 5;
+        continue;
+      }
+    }
+
+    if (ip[0] == OP_GET_LOCAL && next_is(&code, offset, OP_GET_FIELD)) {
+      // Property errors are reported on the line of the GET_FIELD.
+      int field_line = chunk_line(chunk, offset + 2);
+      remap[offset + 2] = out.len;
+      chunk_add(&out, OP_GET_LOCAL_GET_FIELD, field_line);
+      chunk_add(&out, ip[1], field_line);
+      for (int i = 3; i < 7; i++) {
+        chunk_add(&out, ip[i], field_line);
+      }
+      offset += 7;
+      continue;
+    }
+
+    if (ip[0] == OP_CONSTANT && next_is(&code, offset, OP_ADD)) {
+      int add_line = chunk_line(chunk, offset + 2);
+      remap[offset + 2] = out.len;
+      chunk_add(&out, OP_ADD_CONST, add_line);
+      chunk_add(&out, ip[1], add_line);
+      offset += 3;
+      continue;
+    }
+
+    if (ip[0] == OP_SET_LOCAL && next_is(&code, offset, OP_POP)) {
+      remap[offset + 2] = out.len;
+      chunk_add(&out, OP_SET_LOCAL_POP, line);
+      chunk_add(&out, ip[1], line);
+      offset += 3;
+      continue;
+    }
+
+    if (is_jmp(ip[0])) {
+      fixups[fixup_count++]
+          = (Fixup){ out.len + size - 2, jmp_target(chunk, offset, size),
+                     ip[0] == OP_JMP_BACK };
+    }
+    for (int i = 0; i < size; i++) {
+      chunk_add(&out, ip[i], chunk_line(chunk, offset + i));
+    }
+    offset += size;
+  }
+  remap[len] = out.len;
+
+  // Fusing only ever shrinks the code, so every distance still fits.
+  // The distance is the last operand of every jump.
+  for (int i = 0; i < fixup_count; i++) {
+    int from = fixups[i].offset + 2;
+    int to = remap[fixups[i].target];
+    int dist = fixups[i].back ? from - to : to - from;
+    chunk_set(&out, fixups[i].offset, (dist >> 8) & 0xff);
+    chunk_set(&out, fixups[i].offset + 1, dist & 0xff);
+  }
+
+  free_array(int, code.sizes, len);
+  free_array(bool, code.targets, len + 1);
+  free_array(int, remap, len + 1);
+  free_array(Fixup, fixups, jmp_count);
+
+  chunk_free(chunk);
+  *chunk = out;
+}
@@ -0,0 +1,13 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "object.h"
+#include "value.h"
+
+// peephole rewrites the chunk of a compiled function, fusing common
+// instruction sequences into superinstructions, and into register
+// instructions if registers is set. Jumps are relocated and every byte keeps
+// the line of the instruction it came from.
+void peephole(ObjectFunction *, bool registers);
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "profile.h"
+
+#define name(op) [op] = #op
+static const char *op_names[PROFILE_OPS] = {
+    name(OP_RETURN), name(OP_CONSTANT), name(OP_CONSTANT_LONG),
+    name(OP_NEGATIVE), name(OP_NOT),
+    name(OP_MINUS), name(OP_ADD), name(OP_MUL), name(OP_DIV), name(OP_BANG),
+    name(OP_BANG_EQUAL), name(OP_EQUAL), name(OP_EQUAL_EQUAL), name(OP_GREATER),
+    name(OP_GREATER_EQUAL), name(OP_LESS), name(OP_LESS_EQUAL), name(OP_PRINT),
+    name(OP_POP), name(OP_CLOSE), name(OP_GLOBAL), name(OP_LOCAL),
+    name(OP_SET_GLOBAL), name(OP_GET_GLOBAL), name(OP_SET_LOCAL),
+    name(OP_GET_LOCAL), name(OP_SET_UPVALUE), name(OP_GET_UPVALUE),
+    name(OP_JMP), name(OP_JMP_BACK), name(OP_JMP_ON_FALSE), name(OP_CLOSURE),
+    name(OP_CALL), name(OP_CLASS), name(OP_GET_FIELD), name(OP_SET_FIELD),
+    name(OP_METHOD), name(OP_INVOKE), name(OP_DERIVE), name(OP_GET_SUPER),
+    name(OP_END_CLASS),
+    name(OP_GET_LOCAL_GET_FIELD), name(OP_ADD_CONST), name(OP_SET_LOCAL_POP),
+    name(OP_JMP_UNLESS_EQUAL), name(OP_JMP_UNLESS_GREATER),
+    name(OP_JMP_UNLESS_GREATER_EQUAL), name(OP_JMP_UNLESS_LESS),
+    name(OP_JMP_UNLESS_LESS_EQUAL),
+    name(OP_ADD_LL), name(OP_ADD_LC), name(OP_ADD_LL_TO), name(OP_ADD_LC_TO),
+    name(OP_MINUS_LL), name(OP_MINUS_LC), name(OP_MINUS_LL_TO),
+    name(OP_MINUS_LC_TO), name(OP_MUL_LL), name(OP_MUL_LC), name(OP_MUL_LL_TO),
+    name(OP_MUL_LC_TO), name(OP_DIV_LL), name(OP_DIV_LC), name(OP_DIV_LL_TO),
+    name(OP_DIV_LC_TO), name(OP_JMP_UNLESS_EQUAL_LL),
+    name(OP_JMP_UNLESS_EQUAL_LC), name(OP_JMP_UNLESS_GREATER_LL),
+    name(OP_JMP_UNLESS_GREATER_LC), name(OP_JMP_UNLESS_GREATER_EQUAL_LL),
+    name(OP_JMP_UNLESS_GREATER_EQUAL_LC), name(OP_JMP_UNLESS_LESS_LL),
+    name(OP_JMP_UNLESS_LESS_LC), name(OP_JMP_UNLESS_LESS_EQUAL_LL),
+    name(OP_JMP_UNLESS_LESS_EQUAL_LC), name(OP_MOVE), name(OP_LOAD_CONST),
+};
+#undef name
+
+Profile *profile_new(void)
+{
+  Profile *profile = (Profile *)reallocate(NULL, 0, sizeof(Profile));
+  memset(profile, 0, sizeof(Profile));
+  profile->pairs = grow_array(uint64_t, NULL, 0, PROFILE_OPS * PROFILE_OPS);
+  memset(profile->pairs, 0, sizeof(uint64_t) * PROFILE_OPS * PROFILE_OPS);
+  profile->prev = OP_NONE;
+  return profile;
+}
+
+void profile_free(Profile *profile)
+{
+  free_array(uint64_t, profile->pairs, PROFILE_OPS * PROFILE_OPS);
+  reallocate(profile, sizeof(Profile), 0);
+}
+
+void profile_start(Profile *profile)
+{
+  profile->prev = OP_NONE;
+  profile->last = profile_clock();
+}
+
+void profile_stop(Profile *profile)
+{
+  profile->cycles[profile->prev] += profile_clock() - profile->last;
+  profile->prev = OP_NONE;
+}
+
+static const char *op_name(int op)
+{
+  return op_names[op] != NULL ? op_names[op] : "OP_UNKNOWN";
+}
+
+typedef struct {
+  int first;
+  int second;
+  uint64_t count;
+} Row;
+
+// by_count orders rows by descending count.
+static int by_count(const void *a, const void *b)
+{
+  uint64_t x = ((const Row *)a)->count;
+  uint64_t y = ((const Row *)b)->count;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Rows of the report, most frequent first. Rows whose first opcode is
+// OP_NONE stand for the start of a run and are left out.
+typedef struct {
+  Row *rows;
+  int len;
+} Table;
+
+static Table opcode_table(Profile *profile)
+{
+  Table t = { grow_array(Row, NULL, 0, PROFILE_OPS), 0 };
+  for (int op = OP_NONE + 1; op < PROFILE_OPS; op++) {
+    if (profile->counts[op] > 0) {
+      t.rows[t.len++] = (Row){ op, 0, profile->counts[op] };
+    }
+  }
+  qsort(t.rows, t.len, sizeof(Row), by_count);
+  return t;
+}
+
+static Table pair_table(Profile *profile)
+{
+  int len = 0;
+  for (int i = PROFILE_OPS; i < PROFILE_OPS * PROFILE_OPS; i++) {
+    len += profile->pairs[i] > 0;
+  }
+  Table t = { grow_array(Row, NULL, 0, len), 0 };
+  for (int i = PROFILE_OPS; i < PROFILE_OPS * PROFILE_OPS; i++) {
+    if (profile->pairs[i] > 0) {
+      Row row = { i / PROFILE_OPS, i % PROFILE_OPS, profile->pairs[i] };
+      t.rows[t.len++] = row;
+    }
+  }
+  qsort(t.rows, t.len, sizeof(Row), by_count);
+  return t;
+}
+
+// function_table lists the functions that ran, first refers to the function
+// in funs.
+static Table function_table(ObjectFunction **funs, int size)
+{
+  Table t = { grow_array(Row, NULL, 0, size), 0 };
+  for (int i = 0; i < size; i++) {
+    if (funs[i]->profile_count > 0) {
+      t.rows[t.len++] = (Row){ i, 0, funs[i]->profile_count };
+    }
+  }
+  qsort(t.rows, t.len, sizeof(Row), by_count);
+  return t;
+}
+
+static int function_line(ObjectFunction *fun)
+{
+  return fun->chunk.len > 0 ? chunk_line(&fun->chunk, 0) : 0;
+}
+
+static void write_json(FILE *out, Profile *profile, Table *ops, Table *pairs,
+                       Table *calls, ObjectFunction **funs)
+{
+  uint64_t total = 0;
+  for (int i = 0; i < ops->len; i++) {
+    total += ops->rows[i].count;
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"clock\": \"%s\",\n", PROFILE_CLOCK);
+  fprintf(out, "  \"instructions\": %llu,\n", (unsigned long long)total);
+
+  fprintf(out, "  \"opcodes\": [");
+  for (int i = 0; i < ops->len; i++) {
+    Row *row = &ops->rows[i];
+    fprintf(out,
+            "%s\n    {\"name\": \"%s\", \"count\": %llu, "
+            "\"cycles\": %llu}",
+            i > 0 ? "," : "", op_name(row->first),
+            (unsigned long long)row->count,
+            (unsigned long long)profile->cycles[row->first]);
+  }
+  fprintf(out, "\n  ],\n");
+
+  fprintf(out, "  \"pairs\": [");
+  for (int i = 0; i < pairs->len; i++) {
+    Row *row = &pairs->rows[i];
+    fprintf(out,
+            "%s\n    {\"first\": \"%s\", \"second\": \"%s\", "
+            "\"count\": %llu}",
+            i > 0 ? "," : "", op_name(row->first), op_name(row->second),
+            (unsigned long long)row->count);
+  }
+  fprintf(out, "\n  ],\n");
+
+  fprintf(out, "  \"functions\": [");
+  for (int i = 0; i < calls->len; i++) {
+    ObjectFunction *fun = funs[calls->rows[i].first];
+    fprintf(out,
+            "%s\n    {\"name\": \"%s\", \"line\": %d, "
+            "\"instructions\": %llu}",
+            i > 0 ? "," : "", fun->name->str, function_line(fun),
+            (unsigned long long)calls->rows[i].count);
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+static void write_csv(FILE *out, Profile *profile, Table *ops, Table *pairs,
+                      Table *calls, ObjectFunction **funs)
+{
+  fprintf(out, "kind,name,second,count,cycles\n");
+  for (int i = 0; i < ops->len; i++) {
+    Row *row = &ops->rows[i];
+    fprintf(out, "opcode,%s,,%llu,%llu\n", op_name(row->first),
+            (unsigned long long)row->count,
+            (unsigned long long)profile->cycles[row->first]);
+  }
+  for (int i = 0; i < pairs->len; i++) {
+    Row *row = &pairs->rows[i];
+    fprintf(out, "pair,%s,%s,%llu,\n", op_name(row->first),
+            op_name(row->second), (unsigned long long)row->count);
+  }
+  for (int i = 0; i < calls->len; i++) {
+    ObjectFunction *fun = funs[calls->rows[i].first];
+    fprintf(out, "function,%s:%d,,%llu,\n", fun->name->str,
+            function_line(fun), (unsigned long long)calls->rows[i].count);
+  }
+}
+
+int profile_write(Profile *profile, const char *path, ObjectFunction *script,
+                  ValueArray *functions)
+{
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open profile \"%s\".\n", path);
+    return 1;
+  }
+
+  int size = 1;
+  ObjectFunction **funs = grow_array(ObjectFunction *, NULL, 0,
+                                     functions->len + 1);
+  funs[0] = script;
+  for (int i = 0; i < functions->len; i++) {
+    funs[size++] = as_function(functions->value[i]);
+  }
+
+  Table ops = opcode_table(profile);
+  Table pairs = pair_table(profile);
+  Table calls = function_table(funs, size);
+
+  size_t len = strlen(path);
+  if (len >= 4 && strcmp(path + len - 4, ".csv") == 0) {
+    write_csv(out, profile, &ops, &pairs, &calls, funs);
+  } else {
+    write_json(out, profile, &ops, &pairs, &calls, funs);
+  }
+
+  free_array(Row, ops.rows, PROFILE_OPS);
+  free_array(Row, calls.rows, size);
+  free_array(ObjectFunction *, funs, functions->len + 1);
+  free_array(Row, pairs.rows, pairs.len);
+  return fclose(out) != 0;
+}
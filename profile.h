@@ -0,0 +1,65 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <stdint.h>
+
+#include "chunk.h"
+#include "object.h"
+#include "value.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK "rdtsc"
+static inline uint64_t profile_clock(void) { return __rdtsc(); }
+#else
+#include <time.h>
+#define PROFILE_CLOCK "ns"
+static inline uint64_t profile_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#define PROFILE_OPS (UINT8_MAX + 1)
+
+// Profile collects opcode statistics while the vm runs. Time is measured
+// between two dispatches and charged to the earlier opcode, so the cycles of
+// an opcode include the out-of-line handlers and collections it triggers.
+typedef struct {
+  uint64_t counts[PROFILE_OPS];
+  uint64_t cycles[PROFILE_OPS];
+  // pairs[a * PROFILE_OPS + b] counts opcode b executed right after a
+  uint64_t *pairs;
+  uint8_t prev;
+  uint64_t last;
+} Profile;
+
+Profile *profile_new(void);
+void profile_free(Profile *);
+
+// profile_start and profile_stop bracket every run of the interpreter loop.
+void profile_start(Profile *);
+void profile_stop(Profile *);
+
+// profile_record accounts for one dispatch of op in fun.
+static inline void profile_record(Profile *profile, ObjectFunction *fun,
+                                  uint8_t op)
+{
+  uint64_t now = profile_clock();
+  profile->cycles[profile->prev] += now - profile->last;
+  profile->last = now;
+  profile->pairs[profile->prev * PROFILE_OPS + op]++;
+  profile->prev = op;
+  profile->counts[op]++;
+  fun->profile_count++;
+}
+
+// profile_write writes the report to path, as CSV if path ends in ".csv" and
+// as JSON otherwise. The per-function counts are read from script and the
+// function prototypes in functions. It returns 0 on success.
+int profile_write(Profile *, const char *path, ObjectFunction *script,
+                  ValueArray *functions);
+
+#endif
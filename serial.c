@@ -0,0 +1,232 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "serial.h"
+
+uint64_t hash64(const void *bytes, size_t len)
+{
+  const uint8_t *p = bytes;
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void writer_init(Writer *w)
+{
+  w->len = 0;
+  w->cap = 0;
+  w->buf = NULL;
+}
+
+void writer_free(Writer *w)
+{
+  free_array(uint8_t, w->buf, w->cap);
+  writer_init(w);
+}
+
+void put_bytes(Writer *w, const void *bytes, size_t n)
+{
+  if (w->cap < w->len + n) {
+    size_t old_cap = w->cap;
+    while (w->cap < w->len + n) {
+      w->cap = grow_cap(w->cap);
+    }
+    w->buf = grow_array(uint8_t, w->buf, old_cap, w->cap);
+  }
+  memcpy(w->buf + w->len, bytes, n);
+  w->len += n;
+}
+
+void put_u8(Writer *w, uint8_t n) { put_bytes(w, &n, sizeof(n)); }
+
+void put_u32(Writer *w, uint32_t n) { put_bytes(w, &n, sizeof(n)); }
+
+void put_f64(Writer *w, double n) { put_bytes(w, &n, sizeof(n)); }
+
+void put_string(Writer *w, ObjectString *str)
+{
+  put_u32(w, str->len);
+  put_bytes(w, str->str, str->len);
+}
+
+void put_chunk(Writer *w, Chunk *chunk)
+{
+  put_u32(w, chunk->len);
+  put_bytes(w, chunk->code, chunk->len);
+  put_u32(w, chunk->line_len);
+  for (int i = 0; i < chunk->line_len; i++) {
+    put_u32(w, chunk->lines[i].offset);
+    put_u32(w, chunk->lines[i].line);
+  }
+}
+
+void put_slots(Writer *w, Globals *globals)
+{
+  put_u32(w, globals->names.len);
+  for (int i = 0; i < globals->names.len; i++) {
+    put_string(w, as_string(globals->names.value[i]));
+  }
+  put_u32(w, selector_count());
+  for (int i = 0; i < selector_count(); i++) {
+    put_string(w, selector_name(i));
+  }
+}
+
+int write_file(const char *path, const void *header, size_t header_len,
+               Writer *w)
+{
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid())
+      >= (int)sizeof(tmp)) {
+    return 1;
+  }
+
+  FILE *out = fopen(tmp, "wb");
+  if (out == NULL) {
+    return 1;
+  }
+  fwrite(header, header_len, 1, out);
+  fwrite(w->buf, 1, w->len, out);
+  int err = ferror(out);
+  err |= fclose(out);
+  if (err || rename(tmp, path) != 0) {
+    remove(tmp);
+    return 1;
+  }
+  return 0;
+}
+
+int map_file(const char *path, Reader *r)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return 1;
+  }
+  r->start = map;
+  r->pos = r->start;
+  r->end = r->start + st.st_size;
+  r->bad = false;
+  return 0;
+}
+
+void unmap_file(Reader *r)
+{
+  munmap((void *)r->start, r->end - r->start);
+}
+
+const uint8_t *get_bytes(Reader *r, size_t n)
+{
+  if (r->bad || (size_t)(r->end - r->pos) < n) {
+    r->bad = true;
+    return NULL;
+  }
+  const uint8_t *bytes = r->pos;
+  r->pos += n;
+  return bytes;
+}
+
+uint8_t get_u8(Reader *r)
+{
+  const uint8_t *bytes = get_bytes(r, 1);
+  return bytes != NULL ? *bytes : 0;
+}
+
+uint32_t get_u32(Reader *r)
+{
+  uint32_t n = 0;
+  const uint8_t *bytes = get_bytes(r, sizeof(n));
+  if (bytes != NULL) {
+    memcpy(&n, bytes, sizeof(n));
+  }
+  return n;
+}
+
+double get_f64(Reader *r)
+{
+  double n = 0;
+  const uint8_t *bytes = get_bytes(r, sizeof(n));
+  if (bytes != NULL) {
+    memcpy(&n, bytes, sizeof(n));
+  }
+  return n;
+}
+
+ObjectString *get_string(Reader *r)
+{
+  uint32_t len = get_u32(r);
+  const uint8_t *bytes = get_bytes(r, len);
+  if (bytes == NULL) {
+    return NULL;
+  }
+  return (ObjectString *)string_copy((char *)bytes, len);
+}
+
+bool get_chunk(Reader *r, Chunk *chunk)
+{
+  uint32_t len = get_u32(r);
+  const uint8_t *code = get_bytes(r, len);
+  uint32_t line_len = get_u32(r);
+  if (r->bad || line_len > len) {
+    return false;
+  }
+  chunk->code = grow_array(uint8_t, NULL, 0, len);
+  chunk->cap = len;
+  chunk->len = len;
+  memcpy(chunk->code, code, len);
+  chunk->lines = grow_array(LineRun, NULL, 0, line_len);
+  chunk->line_cap = line_len;
+  for (uint32_t i = 0; i < line_len; i++) {
+    chunk->lines[i].offset = get_u32(r);
+    chunk->lines[i].line = get_u32(r);
+  }
+  chunk->line_len = line_len;
+  // chunk_line needs a run at offset 0 and runs in order
+  if (r->bad || (len > 0 && (line_len == 0 || chunk->lines[0].offset != 0))) {
+    return false;
+  }
+  for (uint32_t i = 1; i < line_len; i++) {
+    if (chunk->lines[i].offset <= chunk->lines[i - 1].offset) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool get_slots(Reader *r, Globals *globals)
+{
+  uint32_t global_len = get_u32(r);
+  for (uint32_t i = 0; !r->bad && i < global_len; i++) {
+    ObjectString *name = get_string(r);
+    if (name == NULL
+        || (uint32_t)globals_slot(globals, value_make_object((Object *)name))
+               != i) {
+      return false;
+    }
+  }
+  uint32_t selector_len = get_u32(r);
+  for (uint32_t i = 0; !r->bad && i < selector_len; i++) {
+    ObjectString *name = get_string(r);
+    if (name == NULL || (uint32_t)selector_of(name) != i) {
+      return false;
+    }
+  }
+  return !r->bad;
+}
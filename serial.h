@@ -0,0 +1,79 @@
+#ifndef clox_serial_h
+#define clox_serial_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "globals.h"
+#include "object.h"
+
+// The bytecode cache and the heap image share these helpers to write and
+// read their files. Numbers are written in host order, so a file written on
+// a machine of the other byte order fails the magic check of its header.
+
+// hash64 is the 64-bit FNV-1a hash of len bytes.
+uint64_t hash64(const void *bytes, size_t len);
+
+// Writer collects a file body in memory, as its hash goes before it.
+typedef struct {
+  size_t len;
+  size_t cap;
+  uint8_t *buf;
+} Writer;
+
+void writer_init(Writer *);
+void writer_free(Writer *);
+void put_bytes(Writer *, const void *bytes, size_t n);
+void put_u8(Writer *, uint8_t);
+void put_u32(Writer *, uint32_t);
+void put_f64(Writer *, double);
+void put_string(Writer *, ObjectString *);
+
+// put_chunk writes the code and the line table of a chunk.
+void put_chunk(Writer *, Chunk *);
+
+// put_slots writes the names of the global slots and of the method
+// selectors, which compiled code refers to by number.
+void put_slots(Writer *, Globals *);
+
+// write_file writes header followed by the body in w to path. It writes a
+// file of its own and renames it, so a process reading path never sees it
+// half written. It returns 0 on success.
+int write_file(const char *path, const void *header, size_t header_len,
+               Writer *w);
+
+// Reader reads a file mapped by map_file. Reading past the end sets bad,
+// after which every read fails.
+typedef struct {
+  const uint8_t *start;
+  const uint8_t *pos;
+  const uint8_t *end;
+  bool bad;
+} Reader;
+
+// map_file maps the file at path into r and returns 0 on success. Release
+// it with unmap_file.
+int map_file(const char *path, Reader *r);
+void unmap_file(Reader *r);
+
+const uint8_t *get_bytes(Reader *, size_t n);
+uint8_t get_u8(Reader *);
+uint32_t get_u32(Reader *);
+double get_f64(Reader *);
+
+// get_string returns the interned string read, or NULL if it runs past the
+// end.
+ObjectString *get_string(Reader *);
+
+// get_chunk reads a chunk written by put_chunk into an empty chunk and
+// returns whether it is well formed.
+bool get_chunk(Reader *, Chunk *);
+
+// get_slots reads the names written by put_slots and returns whether each
+// name got the same slot or selector here. That holds as long as they are
+// read before any other code is compiled.
+bool get_slots(Reader *, Globals *);
+
+#endif
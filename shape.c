@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "memory.h"
+#include "shape.h"
+
+static Shape *shape_alloc(ObjectClass *klass, Shape *parent, int size)
+{
+  Shape *shape = (Shape *)reallocate(NULL, 0, sizeof(Shape));
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->size = size;
+  shape->names = size == 0 ? NULL : grow_array(ObjectString *, NULL, 0, size);
+  shape->dictionary = false;
+  shape->children = NULL;
+  shape->child_size = 0;
+  shape->child_cap = 0;
+  return shape;
+}
+
+Shape *shape_new_root(ObjectClass *klass) { return shape_alloc(klass, NULL, 0); }
+
+Shape *shape_new_dictionary(ObjectClass *klass)
+{
+  Shape *shape = shape_alloc(klass, NULL, 0);
+  shape->dictionary = true;
+  return shape;
+}
+
+void shape_free(Shape *shape)
+{
+  for (int i = 0; i < shape->child_size; i++) {
+    shape_free(shape->children[i]);
+  }
+  free_array(Shape *, shape->children, shape->child_cap);
+  free_array(ObjectString *, shape->names, shape->size);
+  reallocate(shape, sizeof(Shape), 0);
+}
+
+int shape_find(Shape *shape, ObjectString *name)
+{
+  // Names are interned, and shapes are small enough for a linear scan.
+  for (int i = 0; i < shape->size; i++) {
+    if (shape->names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+Shape *shape_add(Shape *shape, ObjectString *name)
+{
+  for (int i = 0; i < shape->child_size; i++) {
+    Shape *child = shape->children[i];
+    if (child->names[shape->size] == name) {
+      return child;
+    }
+  }
+
+  Shape *child = shape_alloc(shape->klass, shape, shape->size + 1);
+  if (shape->size > 0) {
+    memcpy(child->names, shape->names, sizeof(ObjectString *) * shape->size);
+  }
+  child->names[shape->size] = name;
+
+  if (shape->child_size == shape->child_cap) {
+    int cap = grow_cap(shape->child_cap);
+    shape->children
+        = grow_array(Shape *, shape->children, shape->child_cap, cap);
+    shape->child_cap = cap;
+  }
+  shape->children[shape->child_size++] = child;
+  return child;
+}
+
+void shape_mark(Shape *shape, ValueArray *wset)
+{
+  // Each name is the newest field of some shape in the tree.
+  if (shape->size > 0) {
+    Object *name = (Object *)shape->names[shape->size - 1];
+    value_array_write(wset, value_make_object(name));
+  }
+  for (int i = 0; i < shape->child_size; i++) {
+    shape_mark(shape->children[i], wset);
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "object.h"
+#include "value.h"
+
+// SHAPE_MAX_FIELDS is the number of fields an instance may have before it
+// gives up on shapes and keeps its fields in a dictionary.
+#define SHAPE_MAX_FIELDS 64
+
+// Shape describes the field layout shared by all instances of a class that
+// got the same fields in the same order: field names[i] lives in slot i.
+//
+// The shapes of a class form a tree rooted at an empty shape. Adding a field
+// to an instance moves it from its shape to the child for that field name,
+// creating the child the first time. Every class also has a dictionary shape
+// for instances with too many fields, whose fields live in a Map instead.
+typedef struct Shape {
+  struct ObjectClass *klass;
+  struct Shape *parent;
+  int size;
+  ObjectString **names;
+  bool dictionary;
+
+  struct Shape **children;
+  int child_size;
+  int child_cap;
+} Shape;
+
+Shape *shape_new_root(struct ObjectClass *);
+Shape *shape_new_dictionary(struct ObjectClass *);
+void shape_free(Shape *);
+
+// shape_find returns the slot of field name, or -1 if the shape has none.
+int shape_find(Shape *, ObjectString *);
+
+// shape_add returns the shape reached by adding field name.
+Shape *shape_add(Shape *, ObjectString *);
+
+// shape_mark writes the field names of the whole tree into the work set.
+void shape_mark(Shape *, ValueArray *);
+
+#endif
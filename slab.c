@@ -0,0 +1,301 @@
+#include <string.h>
+
+#include "memory.h"
+#include "slab.h"
+
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRAIN)
+
+// Slot is a free slot. Its type is 0, which no object has, so walking a page
+// tells free slots and objects apart.
+typedef struct Slot {
+  object_t type;
+  struct Slot *next;
+} Slot;
+
+static Page *pages = NULL;
+static Page *partial[SLAB_CLASSES];
+static Page *young_pages = NULL;
+
+// unswept holds the pages of each size class left to the full sweep, and
+// unswept_large the large objects.
+static Page *unswept[SLAB_CLASSES];
+static Page *unswept_large = NULL;
+static int unswept_count = 0;
+
+static SlabStats stats;
+
+static Page *sweep_class(int cls);
+
+// slot_at returns slot i of the page. A large object is slot 0 of its page.
+#define slot_at(page, i)                                                       \
+  ((Object *)((char *)(page) + SLAB_PAGE_HEADER + (size_t)(i) * (page)->slot_size))
+
+static void link_partial(Page *page, int cls)
+{
+  page->prev_free = NULL;
+  page->next_free = partial[cls];
+  if (partial[cls]) {
+    partial[cls]->prev_free = page;
+  }
+  partial[cls] = page;
+}
+
+static void unlink_partial(Page *page, int cls)
+{
+  if (page->prev_free) {
+    page->prev_free->next_free = page->next_free;
+  } else {
+    partial[cls] = page->next_free;
+  }
+  if (page->next_free) {
+    page->next_free->prev_free = page->prev_free;
+  }
+}
+
+static Page *page_init(Page *page, int slot_size, int slot_count,
+                       size_t bytes)
+{
+  page->prev = NULL;
+  page->next = pages;
+  if (pages) {
+    pages->prev = page;
+  }
+  pages = page;
+
+  page->slot_size = slot_size;
+  page->slot_count = slot_count;
+  page->used = 0;
+  page->bytes = bytes;
+  page->young = false;
+  page->pending = false;
+  page->free = NULL;
+  memset(page->marks, 0, sizeof(page->marks));
+
+  stats.pages++;
+  stats.reserved += bytes;
+  return page;
+}
+
+static Page *page_new(int cls)
+{
+  int slot_size = (cls + 1) * SLAB_GRAIN;
+  int count = (SLAB_PAGE_SIZE - SLAB_PAGE_HEADER) / slot_size;
+  Page *page = (Page *)allocate_aligned(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+  page_init(page, slot_size, count, SLAB_PAGE_SIZE);
+
+  // Thread the free list in address order.
+  for (int i = count - 1; i >= 0; i--) {
+    Slot *slot = (Slot *)slot_at(page, i);
+    slot->type = 0;
+    slot->next = page->free;
+    page->free = slot;
+  }
+  link_partial(page, cls);
+  return page;
+}
+
+static void page_free(Page *page)
+{
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    pages = page->next;
+  }
+  if (page->next) {
+    page->next->prev = page->prev;
+  }
+  if (page->slot_size != 0) {
+    unlink_partial(page, page->slot_size / SLAB_GRAIN - 1);
+  } else {
+    stats.large--;
+  }
+  stats.pages--;
+  stats.reserved -= page->bytes;
+  reallocate(page, page->bytes, 0);
+}
+
+static void page_touch(Page *page)
+{
+  if (!page->young) {
+    page->young = true;
+    page->next_young = young_pages;
+    young_pages = page;
+  }
+}
+
+Object *slab_alloc(int size)
+{
+  stats.objects += size;
+  if (size > SLAB_MAX_SIZE) {
+    size_t bytes = SLAB_PAGE_HEADER + size;
+    Page *page = page_init((Page *)reallocate(NULL, 0, bytes), 0, 1, bytes);
+    page->used = 1;
+    page_touch(page);
+    stats.large++;
+    stats.slots += size;
+    return slot_at(page, 0);
+  }
+
+  int cls = (size + SLAB_GRAIN - 1) / SLAB_GRAIN - 1;
+  Page *page = partial[cls];
+  if (page == NULL) {
+    page = sweep_class(cls);
+  }
+  if (page == NULL) {
+    page = page_new(cls);
+  }
+  Slot *slot = page->free;
+  page->free = slot->next;
+  page->used++;
+  if (page->free == NULL) {
+    unlink_partial(page, cls);
+  }
+  page_touch(page);
+  stats.slots += page->slot_size;
+  return (Object *)slot;
+}
+
+static void slot_free(Page *page, Object *obj)
+{
+  stats.objects -= obj->size;
+  stats.slots -= page->slot_size == 0 ? obj->size : (uint32_t)page->slot_size;
+  object_free(obj);
+  page->used--;
+  Slot *slot = (Slot *)obj;
+  slot->type = 0;
+  if (page->slot_size == 0) {
+    return;
+  }
+  if (page->free == NULL) {
+    link_partial(page, page->slot_size / SLAB_GRAIN - 1);
+  }
+  slot->next = page->free;
+  page->free = slot;
+}
+
+// sweep_young_page frees the unmarked young objects of the page and
+// promotes the others.
+static void sweep_young_page(Page *page)
+{
+  for (int i = 0; i < page->slot_count; i++) {
+    Object *obj = slot_at(page, i);
+    if (obj->type == 0 || obj->old) {
+      continue;
+    }
+    if (!slab_marked(obj)) {
+      slot_free(page, obj);
+    } else {
+      obj->old = true;
+    }
+  }
+  // Only the young objects were marked, unless the page is left to the full
+  // sweep, which needs the marks of the old ones.
+  if (!page->pending) {
+    memset(page->marks, 0, sizeof(page->marks));
+  }
+}
+
+// sweep_old_page frees the unmarked old objects of the page and clears the
+// marks.
+static void sweep_old_page(Page *page)
+{
+  for (int i = 0; i < page->slot_count; i++) {
+    Object *obj = slot_at(page, i);
+    if (obj->type != 0 && obj->old && !slab_marked(obj)) {
+      slot_free(page, obj);
+    }
+  }
+  memset(page->marks, 0, sizeof(page->marks));
+  page->pending = false;
+  unswept_count--;
+}
+
+void slab_sweep_young(void)
+{
+  Page *page = young_pages;
+  young_pages = NULL;
+  while (page) {
+    Page *next = page->next_young;
+    page->young = false;
+    sweep_young_page(page);
+    // Pages left to the full sweep are freed by it.
+    if (page->used == 0 && !page->pending) {
+      page_free(page);
+    }
+    page = next;
+  }
+}
+
+void slab_start_sweep(void)
+{
+  for (Page *page = pages; page; page = page->next) {
+    page->pending = true;
+    if (page->slot_size == 0) {
+      page->next_unswept = unswept_large;
+      unswept_large = page;
+    } else {
+      int cls = page->slot_size / SLAB_GRAIN - 1;
+      page->next_unswept = unswept[cls];
+      unswept[cls] = page;
+    }
+    unswept_count++;
+  }
+}
+
+// sweep_class sweeps the pages of a size class left to the full sweep until
+// one has a free slot, and returns it, or NULL if none has.
+static Page *sweep_class(int cls)
+{
+  while (unswept[cls]) {
+    Page *page = unswept[cls];
+    unswept[cls] = page->next_unswept;
+    sweep_old_page(page);
+    if (page->free != NULL) {
+      return page;
+    }
+  }
+  return NULL;
+}
+
+// next_unswept takes a page left to the full sweep, large objects first.
+static Page *next_unswept(void)
+{
+  Page **list = &unswept_large;
+  for (int cls = 0; *list == NULL && cls < SLAB_CLASSES; cls++) {
+    list = &unswept[cls];
+  }
+  Page *page = *list;
+  if (page != NULL) {
+    *list = page->next_unswept;
+  }
+  return page;
+}
+
+bool slab_sweep(int pages)
+{
+  for (int i = 0; i < pages && unswept_count > 0; i++) {
+    Page *page = next_unswept();
+    sweep_old_page(page);
+    // Young pages are freed by the next young sweep.
+    if (page->used == 0 && !page->young) {
+      page_free(page);
+    }
+  }
+  return unswept_count == 0;
+}
+
+bool slab_sweeping(void) { return unswept_count > 0; }
+
+void slab_each(void (*fn)(Object *))
+{
+  for (Page *page = pages; page; page = page->next) {
+    for (int i = 0; i < page->slot_count; i++) {
+      Object *obj = slot_at(page, i);
+      if (obj->type != 0) {
+        fn(obj);
+      }
+    }
+  }
+}
+
+void slab_stats(SlabStats *out) { *out = stats; }
@@ -0,0 +1,111 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+// Objects of up to SLAB_MAX_SIZE bytes are carved out of SLAB_PAGE_SIZE
+// pages. The slots of a page all have the same size class, a multiple of
+// SLAB_GRAIN, and free slots are kept on a free list per page. Bigger
+// objects get a page of their own.
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_GRAIN 16
+#define SLAB_MAX_SIZE 256
+
+#define SLAB_MARK_WORDS (SLAB_PAGE_SIZE / SLAB_GRAIN / 64)
+
+typedef struct Page {
+  // every page of the heap
+  struct Page *prev;
+  struct Page *next;
+
+  // pages of the same size class with free slots
+  struct Page *prev_free;
+  struct Page *next_free;
+
+  // pages which got objects since the last young sweep
+  struct Page *next_young;
+
+  // pages of the same size class left to the full sweep
+  struct Page *next_unswept;
+
+  int slot_size; // 0 for a page holding a large object
+  int slot_count;
+  int used;
+  size_t bytes;
+
+  bool young;   // on the young list
+  bool pending; // not reached yet by the full sweep in progress
+  struct Slot *free;
+
+  // marks has a bit for every SLAB_GRAIN bytes of the page, set if the
+  // object starting there is marked.
+  uint64_t marks[SLAB_MARK_WORDS];
+} Page;
+
+#define SLAB_PAGE_HEADER                                                       \
+  ((sizeof(Page) + SLAB_GRAIN - 1) / SLAB_GRAIN * SLAB_GRAIN)
+
+// slab_page returns the page of an object. Slab pages are aligned to their
+// size, and a large object follows the header of its page.
+static inline Page *slab_page(Object *obj)
+{
+  if (obj->size > SLAB_MAX_SIZE) {
+    return (Page *)((char *)obj - SLAB_PAGE_HEADER);
+  }
+  return (Page *)((uintptr_t)obj & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline size_t slab_bit(Page *page, Object *obj)
+{
+  return (size_t)((char *)obj - (char *)page) / SLAB_GRAIN;
+}
+
+static inline bool slab_marked(Object *obj)
+{
+  Page *page = slab_page(obj);
+  size_t bit = slab_bit(page, obj);
+  return (page->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void slab_mark(Object *obj)
+{
+  Page *page = slab_page(obj);
+  size_t bit = slab_bit(page, obj);
+  page->marks[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+// slab_alloc returns room for an object of size bytes. Objects are young
+// until slab_sweep_young promotes them. If no page of the size class has a
+// free slot, the pages left to the full sweep are swept first.
+Object *slab_alloc(int size);
+
+// slab_sweep_young frees the young objects that are not marked and promotes
+// the others. Only the pages that got objects since the last call are swept.
+void slab_sweep_young(void);
+
+// A full sweep frees the old objects that are not marked. slab_start_sweep
+// starts it, leaving every page to sweep, and slab_sweep sweeps at most
+// pages of them and returns whether the sweep is done. Until a page is swept
+// the objects promoted into it keep their mark.
+void slab_start_sweep(void);
+bool slab_sweep(int pages);
+bool slab_sweeping(void);
+
+// slab_each calls fn for every object.
+void slab_each(void (*fn)(Object *));
+
+typedef struct {
+  int pages;          // pages, large objects included
+  int large;          // pages holding a single large object
+  size_t reserved;    // bytes of all pages
+  size_t slots;       // bytes of the slots in use
+  size_t objects;     // bytes of the objects in use
+} SlabStats;
+
+void slab_stats(SlabStats *);
+
+#endif
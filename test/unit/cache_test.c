@@ -0,0 +1,106 @@
+#include "cache.h"
+#include "compiler.h"
+#include "object.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE "/tmp/clox_cache_test.loxc"
+
+static char *src = "fun outer(n) {\n"
+                   "  var k = 1.5;\n"
+                   "  fun inner() { return n + k; }\n"
+                   "  return inner;\n"
+                   "}\n"
+                   "class A { get() { return \"a\"; } }\n"
+                   "print outer(1)() + 300000;\n"
+                   "print A().get();\n";
+
+static void check(bool cond, const char *what)
+{
+  if (!cond) {
+    printf("%s\n", what);
+    exit(1);
+  }
+}
+
+static ObjectFunction *new_script()
+{
+  return (ObjectFunction *)fun_new(0, (ObjectString *)string_copy("script", 6));
+}
+
+// same_function compares the compiled form of two functions, recursing into
+// the functions among their constants.
+static bool same_function(ObjectFunction *a, ObjectFunction *b)
+{
+  if (a->arity != b->arity || a->upvalue_size != b->upvalue_size
+      || a->slot_size != b->slot_size || a->ic_size != b->ic_size
+      || a->chunk.len != b->chunk.len || a->constants.len != b->constants.len
+      || strcmp(a->name->str, b->name->str) != 0
+      || memcmp(a->chunk.code, b->chunk.code, a->chunk.len) != 0) {
+    return false;
+  }
+  for (int i = 0; i < a->chunk.len; i++) {
+    if (chunk_line(&a->chunk, i) != chunk_line(&b->chunk, i)) {
+      return false;
+    }
+  }
+  for (int i = 0; i < a->constants.len; i++) {
+    Value x = a->constants.value[i];
+    Value y = b->constants.value[i];
+    if (is_fun(x) && is_fun(y)) {
+      if (!same_function(as_function(x), as_function(y))) {
+        return false;
+      }
+    } else if (!value_equal(x, y)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void test_round_trip()
+{
+  Globals globals;
+  globals_init(&globals);
+  ValueArray functions;
+  value_array_init(&functions);
+
+  ObjectFunction *script = new_script();
+  check(compile(src, script, &functions, &globals) == 0, "compile failed");
+  remove(CACHE);
+  check(cache_write(CACHE, src, script, &globals) == 0, "write failed");
+
+  ValueArray loaded;
+  value_array_init(&loaded);
+  ObjectFunction *copy = new_script();
+  check(cache_load(CACHE, src, copy, &loaded, &globals) == 0, "load failed");
+  check(same_function(script, copy), "loaded script differs");
+  check(loaded.len == functions.len, "loaded functions differ");
+
+  // A cache is only used for the source it was written for.
+  char *changed = strdup(src);
+  changed[strlen(changed) - 3] = 'b';
+  ObjectFunction *stale = new_script();
+  check(cache_load(CACHE, changed, stale, &loaded, &globals) != 0,
+        "stale cache loaded");
+  check(stale->chunk.len == 0, "stale load left code behind");
+  free(changed);
+
+  // Nor once it is damaged.
+  FILE *file = fopen(CACHE, "r+b");
+  fseek(file, -5, SEEK_END);
+  fputc(0xff, file);
+  fclose(file);
+  check(cache_load(CACHE, src, new_script(), &loaded, &globals) != 0,
+        "damaged cache loaded");
+
+  remove(CACHE);
+}
+
+int main()
+{
+  test_round_trip();
+  return 0;
+}
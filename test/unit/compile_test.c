@@ -0,0 +1,108 @@
+#include "chunk.h"
+#include "compiler.h"
+#include "object.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// gen_source generates a script declaring n functions, each with its own
+// distinct parameter and local names.
+char *gen_source(int n)
+{
+  int cap = n * 128;
+  char *src = malloc(cap);
+  int len = 0;
+  for (int i = 0; i < n; i++) {
+    len += snprintf(src + len, cap - len,
+                    "fun f%d(a%d, b%d) {\n"
+                    "  var c%d = a%d + b%d;\n"
+                    "  return c%d;\n"
+                    "}\n",
+                    i, i, i, i, i, i, i);
+  }
+  return src;
+}
+
+double compile_time(int n)
+{
+  char *src = gen_source(n);
+  ValueArray functions;
+  value_array_init(&functions);
+  Globals globals;
+  globals_init(&globals);
+  ObjectFunction *script
+      = (ObjectFunction *)fun_new(0, (ObjectString *)string_copy("script", 6));
+
+  clock_t start = clock();
+  if (compile(src, script, &functions, &globals)) {
+    printf("Failed to compile %d functions.\n", n);
+    exit(2);
+  }
+  clock_t finish = clock();
+
+  free(src);
+  return (double)(finish - start) / CLOCKS_PER_SEC;
+}
+
+int test_compile()
+{
+  // The script holds a closure constant per function, so the largest size
+  // stays under its 65536-entry constant pool.
+  int sizes[] = { 10000, 20000, 40000, 60000 };
+  double base = 0;
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    double duration = compile_time(sizes[i]);
+    printf("Use %f seconds to compile %d functions, %f per function.\n",
+           duration, sizes[i], duration / sizes[i]);
+    if (i == 0) {
+      base = duration / sizes[i];
+    } else if (base > 0 && duration / sizes[i] > base * 4) {
+      printf("Compile time grows faster than the source size.\n");
+      exit(2);
+    }
+  }
+}
+
+// test_repl compiles lines into the same script one after another, as the
+// repl does, and checks that each of them compiles.
+int test_repl()
+{
+  // Register instructions on a local whose slot number reads as OP_JMP, so
+  // that the optimizer decoding them wrongly on a later line would show.
+  char wide[1024];
+  int len = snprintf(wide, sizeof(wide), "{");
+  for (int i = 0; i <= OP_JMP; i++) {
+    len += snprintf(wide + len, sizeof(wide) - len, " var a%d = %d;", i, i);
+  }
+  snprintf(wide + len, sizeof(wide) - len,
+           " a%d = a0 + a1; while (a0 < a1) a0 = a0 + 1; }", OP_JMP - 1);
+
+  char *lines[] = {
+    "{ var x = 1; var y = 2; print x + y; }",
+    "print 3;",
+    wide,
+    "print 4;",
+  };
+  ValueArray functions;
+  value_array_init(&functions);
+  Globals globals;
+  globals_init(&globals);
+  ObjectFunction *script
+      = (ObjectFunction *)fun_new(0, (ObjectString *)string_copy("script", 6));
+
+  for (int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    if (compile(lines[i], script, &functions, &globals)) {
+      printf("Failed to compile repl line %d: %s\n", i + 1, lines[i]);
+      exit(2);
+    }
+  }
+}
+
+int main()
+{
+  test_compile();
+  test_repl();
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "compiler.h"
+#include "image.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE "/tmp/clox_image_test.img"
+
+static char *setup = "class A {\n"
+                     "  init(n) { this.n = n; }\n"
+                     "  get() { return this.n; }\n"
+                     "}\n"
+                     "class B < A { get() { return super.get() * 2; } }\n"
+                     "fun counter() {\n"
+                     "  var i = 0;\n"
+                     "  fun next() { i = i + 1; return i; }\n"
+                     "  return next;\n"
+                     "}\n"
+                     "var next = counter();\n"
+                     "next();\n"
+                     "var b = B(20);\n"
+                     "b.self = b;\n";
+
+static char *use = "var result = next() + b.self.get() + B(1).get();\n";
+
+static VM first;
+static VM second;
+static VM third;
+
+static void check(bool cond, const char *what)
+{
+  if (!cond) {
+    printf("%s\n", what);
+    exit(1);
+  }
+}
+
+static void run(VM *vm, char *src)
+{
+  check(compile(src, as_function(vm->vmain), &vm->functions, &vm->globals)
+            == 0,
+        "compile failed");
+  vm_run(vm);
+  check(!vm->error, "run failed");
+}
+
+static Value global(VM *vm, char *name)
+{
+  Value key = value_make_string(name, strlen(name));
+  return vm->globals.values.value[globals_slot(&vm->globals, key)];
+}
+
+void test_round_trip()
+{
+  vm_init(&first);
+  run(&first, setup);
+  remove(IMAGE);
+  check(image_write(IMAGE, &first) == 0, "write failed");
+
+  // The restored program picks up where the first one stopped.
+  vm_init(&second);
+  check(image_load(IMAGE, &second) == 0, "load failed");
+  run(&second, use);
+  Value result = global(&second, "result");
+  check(is_number(result) && as_number(result) == 2 + 40 + 2,
+        "restored heap differs");
+
+  // A damaged image is never loaded.
+  FILE *file = fopen(IMAGE, "r+b");
+  fseek(file, -5, SEEK_END);
+  fputc(0xff, file);
+  fclose(file);
+  vm_init(&third);
+  check(image_load(IMAGE, &third) != 0, "damaged image loaded");
+
+  remove(IMAGE);
+}
+
+int main()
+{
+  test_round_trip();
+  return 0;
+}
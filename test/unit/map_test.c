@@ -10015,58 +10015,241 @@ struct test_case test_cases[] = {
 {"fbybacig", "ghucqqgvtqgaqjflylkqhmiuqmuuyiaytlvssotfilgfudkfkeqsbbzvalyskzrcxqattgctisykccdksnulenzpuqdmprwgjjsk"},
 };
 
-int test_map()
+// map_test checks map_put, map_get, map_del and iteration against the test
+// cases, then times them. Run it with test/unit/build map_test.
+
+#define check(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf(__VA_ARGS__);                                                     \
+      printf("\n");                                                            \
+      exit(2);                                                                 \
+    }                                                                          \
+  } while (0)
+
+static Value keys[CASE_COUNT];
+static Value vals[CASE_COUNT];
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, int ops, double start)
+{
+  double ns = (now() - start) * 1e9 / ops;
+  printf("%-8s %9d ops %8.1f ns/op\n", what, ops, ns);
+}
+
+static void check_get(Map *map, int i, bool present)
 {
+  Value val;
+  int found = map_get(map, keys[i], &val);
+  if (!present) {
+    check(!found, "Expect no key %s, but got one.", test_cases[i].key);
+    return;
+  }
+  check(found, "Expect found key %s, but got nothing.", test_cases[i].key);
+  check(val == vals[i], "For key %s, expect got value %s, but got %s.",
+        test_cases[i].key, test_cases[i].val, as_string(val)->str);
+}
+
+static int count(Map *map)
+{
+  int n = 0;
+  MapIter iter;
+  map_iter_init(&iter, map);
+  while (map_iter_next(&iter)) {
+    n++;
+  }
+  return n;
+}
+
+static void test_map(void)
+{
+  // Some keys repeat among the cases; the last value put wins.
+  int last[CASE_COUNT];
+  int distinct = 0;
+  Map seen;
+  map_init(&seen);
+  for (int i = 0; i < CASE_COUNT; i++) {
+    keys[i] = value_make_string(test_cases[i].key, strlen(test_cases[i].key));
+    vals[i] = value_make_string(test_cases[i].val, strlen(test_cases[i].val));
+    Value first;
+    if (map_get(&seen, keys[i], &first)) {
+      last[(int)as_number(first)] = i;
+      last[i] = -1;
+    } else {
+      map_put(&seen, keys[i], value_make_number(i));
+      last[i] = i;
+      distinct++;
+    }
+  }
+  map_free(&seen);
+
   Map map;
   map_init(&map);
-  clock_t start, finish;
-  double duration;
+  for (int i = 0; i < CASE_COUNT; i++) {
+    map_put(&map, keys[i], vals[i]);
+  }
+  check(map.used == distinct, "Expect %d keys, but got %d.", distinct,
+        map.used);
+  check(count(&map) == distinct, "Expect to iterate %d keys.", distinct);
+  for (int i = 0; i < CASE_COUNT; i++) {
+    if (last[i] >= 0) {
+      vals[i] = vals[last[i]];
+      check_get(&map, i, true);
+    }
+  }
 
-  // Test put
-  printf("=== Test map_put\n");
-  start = clock();
+  // Delete every other key, then put them back.
+  for (int i = 0; i < CASE_COUNT; i += 2) {
+    if (last[i] >= 0) {
+      check(map_del(&map, keys[i]), "Expect to delete %s.", test_cases[i].key);
+      check(!map_del(&map, keys[i]), "Expect %s gone.", test_cases[i].key);
+    }
+  }
   for (int i = 0; i < CASE_COUNT; i++) {
-    struct test_case *c = &test_cases[i];
-    Value key = value_make_string(c->key, strlen(c->key));
-    Value val = value_make_string(c->val, strlen(c->val));
-    map_put(&map, key, val);
+    if (last[i] >= 0) {
+      check_get(&map, i, i % 2 == 1);
+    }
   }
-  finish = clock();
-  duration = (double)(finish - start) / CLOCKS_PER_SEC;
-  printf("Use %f seconds to put %d entries, average put duration = %f.\n",
-         duration, CASE_COUNT, duration / CASE_COUNT);
+  for (int i = 0; i < CASE_COUNT; i += 2) {
+    if (last[i] >= 0) {
+      map_put(&map, keys[i], vals[i]);
+    }
+  }
+  for (int i = 0; i < CASE_COUNT; i++) {
+    if (last[i] >= 0) {
+      check_get(&map, i, true);
+    }
+  }
+  map_free(&map);
 
-  // Test get
-  printf("=== Test map_get\n");
-  int test_num = 20000;
-  clock_t total = 0;
-  for (int i = 0; i < test_num; i++) {
-    int idx = rand() % CASE_COUNT;
-    struct test_case *c = &test_cases[idx];
-    Value key = value_make_string(c->key, strlen(c->key));
+  // Churn through all keys keeping few of them alive. The tombstones must be
+  // reclaimed without growing the table.
+  map_init(&map);
+  for (int i = 0; i < CASE_COUNT; i++) {
+    map_put(&map, keys[i], vals[i]);
+    if (i >= 8) {
+      map_del(&map, keys[i - 8]);
+    }
+  }
+  check(map.size <= 4 * MAP_GROUP, "Expect a small table, but got %d slots.",
+        map.size);
+  for (int i = CASE_COUNT - 8; i < CASE_COUNT; i++) {
     Value val;
+    check(map_get(&map, keys[i], &val), "Expect found key %s after churn.",
+          test_cases[i].key);
+  }
+  map_free(&map);
+}
+
+// A map holds up to MAP_SMALL items without a table, and moves to one when
+// more are put.
+static void test_small_map(void)
+{
+  Map map;
+  map_init(&map);
+  check(map.size == 0 && !map_get(&map, keys[0], NULL), "Expect empty map.");
+  for (int i = 0; i < MAP_SMALL; i++) {
+    map_put(&map, value_make_number(i), keys[i]);
+  }
+  map_put(&map, value_make_number(0), keys[MAP_SMALL]);
+  check(map.size == 0, "Expect %d items inline.", MAP_SMALL);
+  check(count(&map) == MAP_SMALL, "Expect to iterate %d items.", MAP_SMALL);
 
-    start = clock();
-    int found = map_get(&map, key, &val);
-    finish = clock();
-    total += finish - start;
-    if (found == 0) {
-      printf("Expect found key %s, but got nothing.\n", c->key);
-      exit(2);
+  // Deleting while iterating visits every item once.
+  int seen = 0;
+  MapIter iter;
+  map_iter_init(&iter, &map);
+  while (map_iter_next(&iter)) {
+    seen++;
+    if (as_number(iter.key) < 2) {
+      map_del(&map, iter.key);
     }
-    struct obj_string *s = object_as(value_as_obj(val), struct obj_string);
-    if (strcmp(s->str, c->val) != 0) {
-      printf("For key %s, expect got value %s, but got %s.\n", c->key, c->val, s->str);
-      exit(2);
+  }
+  check(seen == MAP_SMALL && map.used == MAP_SMALL - 2,
+        "Expect %d items visited, saw %d.", MAP_SMALL, seen);
+
+  for (int i = 0; i < 2 * MAP_SMALL; i++) {
+    map_put(&map, value_make_number(i), keys[i]);
+  }
+  check(map.size != 0, "Expect a table past %d items.", MAP_SMALL);
+  for (int i = 0; i < 2 * MAP_SMALL; i++) {
+    Value val;
+    check(map_get(&map, value_make_number(i), &val) && val == keys[i],
+          "Expect item %d after the move.", i);
+  }
+  map_free(&map);
+}
+
+static void bench_map(void)
+{
+  int rounds = 100;
+  Map map;
+  double start;
+
+  printf("=== Benchmark\n");
+  start = now();
+  for (int r = 0; r < rounds; r++) {
+    map_init(&map);
+    for (int i = 0; i < CASE_COUNT; i++) {
+      map_put(&map, keys[i], vals[i]);
     }
+    map_free(&map);
+  }
+  report("put", rounds * CASE_COUNT, start);
+
+  map_init(&map);
+  for (int i = 0; i < CASE_COUNT; i++) {
+    map_put(&map, keys[i], vals[i]);
+  }
+  Value val;
+  int found = 0;
+  start = now();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < CASE_COUNT; i++) {
+      found += map_get(&map, keys[(i * 7919) % CASE_COUNT], &val);
+    }
+  }
+  report("get", rounds * CASE_COUNT, start);
+
+  // Values are never keys, so looking them up misses.
+  start = now();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < CASE_COUNT; i++) {
+      found += map_get(&map, vals[i], &val);
+    }
+  }
+  report("miss", rounds * CASE_COUNT, start);
+  map_free(&map);
+
+  map_init(&map);
+  start = now();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < CASE_COUNT; i++) {
+      map_put(&map, keys[i], vals[i]);
+      map_del(&map, keys[(i + CASE_COUNT - 64) % CASE_COUNT]);
+    }
+  }
+  report("churn", rounds * CASE_COUNT, start);
+  map_free(&map);
+
+  // Keep the lookups from being optimized away.
+  if (found == 0) {
+    printf("nothing found\n");
   }
-  int avg_clk = total / test_num;
-  double avg_get = avg_clk / CLOCKS_PER_SEC;
-  printf("Used %f seconds to get %d entries. Average get time %f.\n", (double)total / CLOCKS_PER_SEC, test_num, avg_get);
 }
 
 int main()
 {
+  printf("=== Test map\n");
   test_map();
+  test_small_map();
+  printf("ok\n");
+  bench_map();
   return 0;
-}
\ No newline at end of file
+}
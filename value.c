@@ -4,6 +4,8 @@
 
 #include "debug.h"
 #include "memory.h"
+#include "object.h"
+#include "slab.h"
 #include "value.h"
 
 // FNV-1a hash function
@@ -17,115 +19,220 @@ uint32_t FNV1a_hash(const char *key, int length)
   return hash;
 }
 
-// heap maintains a list of allocated object
-static Object *heap = NULL;
+#define GC_HEAP_GROW_FACTOR 2
+
+// NURSERY_SIZE is how many bytes of objects may be allocated between two
+// minor collections.
+#define NURSERY_SIZE (256 * 1024)
+
+// SLICE_SIZE is how many bytes of objects may be allocated between two
+// slices of a full collection, which must keep pace with the allocations.
+#define SLICE_SIZE (32 * 1024)
+
+// collector is called from object_alloc, for a minor collection once the
+// young objects outgrow the nursery, for a full one once the heap grows past
+// next_gc, and for a slice of a full one in progress every SLICE_SIZE bytes.
+// Minor collections wait while a full one is marking.
+static gc_fn collector = NULL;
+static void *collector_arg = NULL;
+static unsigned int next_gc = 1024 * 1024;
+static unsigned int young_size = 0;
+static unsigned int slice_size = 0;
+static bool collecting = false;
+
+// gray holds the objects a full collection has yet to mark, while marking is
+// set. Objects allocated meanwhile and objects the write barrier stores are
+// added to it, so none of them is missed.
+static ValueArray gray;
+bool heap_marking = false;
+
+// remembered holds the old objects which may reference young ones.
+static Object **remembered = NULL;
+static int remembered_len = 0;
+static int remembered_cap = 0;
+
+void heap_set_collector(gc_fn fn, void *arg)
+{
+  collector = fn;
+  collector_arg = arg;
+}
+
+static void collect(gc_kind kind)
+{
+  collecting = true;
+  collector(collector_arg, kind);
+  collecting = false;
+  slice_size = 0;
+  if (kind != GC_SLICE) {
+    young_size = 0;
+  }
+}
+
+// cycle is set from the start of a full collection until it is swept.
+static bool cycle = false;
+
+// in_cycle returns whether a full collection is in progress. The allocator
+// may finish its sweep, so the end of a collection is noticed here.
+static bool in_cycle(void)
+{
+  if (cycle && !heap_marking && !slab_sweeping()) {
+    cycle = false;
+    next_gc = mem_alloc() * GC_HEAP_GROW_FACTOR;
+  }
+  return cycle;
+}
+
+ValueArray *heap_gray(void) { return &gray; }
+
+void heap_shade(Object *obj) { value_array_write(&gray, value_make_object(obj)); }
+
+bool heap_marked(Object *obj) { return slab_marked(obj); }
+
+void heap_remember(Object *obj)
+{
+  if (remembered_len == remembered_cap) {
+    int cap = grow_cap(remembered_cap);
+    remembered = grow_array(Object *, remembered, remembered_cap, cap);
+    remembered_cap = cap;
+  }
+  obj->remembered = true;
+  remembered[remembered_len++] = obj;
+}
+
+Object **heap_remembered(int *len)
+{
+  *len = remembered_len;
+  return remembered;
+}
+
+// forget_remembered empties the remembered set. Every young object is
+// promoted or freed by a sweep, so afterwards no old object references a
+// young one.
+static void forget_remembered(void)
+{
+  for (int i = 0; i < remembered_len; i++) {
+    remembered[i]->remembered = false;
+  }
+  remembered_len = 0;
+}
+
+static void trace_object(Object *obj)
+{
+  if (slab_marked(obj)) {
+    printf("mark    ");
+  } else {
+    printf("        ");
+  }
+  printf(obj->old ? "old   " : "young ");
+  object_print(obj);
+  printf("\n");
+}
 
 void trace_heap()
 {
-  Object *item = heap;
   printf("===== Trace Heap Begin =====\n");
   printf("Heap Size: %d\n", mem_alloc());
-  while (item) {
-    if (item->marked) {
-      printf("mark    ");
-    } else {
-      printf("        ");
-    }
-    object_print(item);
-    printf("\n");
-    item = item->next;
-  }
+  slab_each(trace_object);
   printf("===== Trace Heap End   =====\n");
 }
 
-void sweep_heap(void)
+void sweep_young(void)
 {
-  Object **objp = &heap;
-  while (*objp) {
-    Object *obj = *objp;
-    if ((obj)->marked != true) {
-      *objp = obj->next;
-      object_free(obj);
-      reallocate(obj, obj->size, 0);
-    } else {
-      (*objp)->marked = false;
-      objp = &(*objp)->next;
-    }
-  }
+  forget_remembered();
+  slab_sweep_young();
+}
+
+void heap_start_marking(void)
+{
+  heap_marking = true;
+  cycle = true;
 }
 
+void heap_finish_marking(void)
+{
+  heap_marking = false;
+  // The survivors the young sweep promotes into the pages left to sweep
+  // keep their mark, so the full sweep does not free them.
+  slab_start_sweep();
+  sweep_young();
+}
+
+bool heap_sweeping(void) { return slab_sweeping(); }
+
+bool heap_sweep(int pages) { return slab_sweep(pages); }
+
 // object_alloc allocates size memory for new object and set up corresponding
 // fields
-Object *object_alloc(int size, object_t type, uint32_t hash,
-                     bool (*equal_fn)(Object *, Object *),
-                     void (*format)(Object *), void (*destructor)(Object *))
+Object *object_alloc(int size, object_t type)
 {
-  Object *item = (Object *)reallocate(NULL, 0, size);
-  item->next = heap;
-  item->marked = false;
-  heap = item;
+#if defined(STRESS_GC) || defined(DEBUG_GC)
+  // Mostly minor collections, to exercise the write barrier.
+  static unsigned int stress_count = 0;
+  if (collector && !collecting) {
+    stress_count++;
+    if (heap_marking || (in_cycle() && stress_count % 2 == 0)) {
+      collect(GC_SLICE);
+    } else if (!in_cycle() && stress_count % 8 == 0) {
+      collect(GC_FULL);
+    } else {
+      collect(GC_MINOR);
+    }
+  }
+#else
+  if (collector && !collecting) {
+    if (in_cycle() && slice_size + size > SLICE_SIZE) {
+      collect(GC_SLICE);
+    } else if (!in_cycle() && mem_alloc() + size > next_gc) {
+      collect(GC_FULL);
+    } else if (!heap_marking && young_size + size > NURSERY_SIZE) {
+      collect(GC_MINOR);
+    }
+  }
+#endif
+
+  Object *item = slab_alloc(size);
+  item->old = false;
+  item->remembered = false;
+  young_size += size;
+  slice_size += size;
+  if (heap_marking) {
+    heap_shade(item);
+  }
 
   item->type = type;
-  item->hash = hash;
   item->size = size;
-  item->equal = equal_fn;
-  item->format = format;
-  item->destructor = destructor;
 
   return item;
 }
 
-void object_free(Object *obj) { return obj->destructor(obj); }
+void object_free(Object *obj)
+{
+  void (*destructor)(Object *) = object_vtables[obj->type].destructor;
+  if (destructor != NULL) {
+    destructor(obj);
+  }
+}
 
 bool object_equal(Object *obj1, Object *obj2)
 {
   if (obj1->type != obj2->type) {
     return false;
   }
-  if (obj1->equal == NULL) {
+  bool (*equal)(Object *, Object *) = object_vtables[obj1->type].equal;
+  if (equal == NULL) {
     return obj1 == obj2;
   }
-  return obj1->equal(obj1, obj2);
+  return equal(obj1, obj2);
 }
 
 void object_print(Object *obj)
 {
-  if (obj->format == NULL) {
+  void (*format)(Object *) = object_vtables[obj->type].format;
+  if (format == NULL) {
     printf("type should not format");
     return;
   }
-  return obj->format(obj);
-}
-
-Value value_make_nil()
-{
-  Value value;
-  value.type = VT_NIL;
-  return value;
-}
-
-Value value_make_bool(bool boolean)
-{
-  Value value;
-  value.type = VT_BOOL;
-  value.as.boolean = boolean;
-  return value;
-}
-
-Value value_make_number(double number)
-{
-  Value value;
-  value.type = VT_NUM;
-  value.as.number = number;
-  return value;
-}
-
-Value value_make_object(Object *obj)
-{
-  Value value;
-  value.type = VT_OBJ;
-  value.as.obj = obj;
-  return value;
+  return format(obj);
 }
 
 void value_array_init(ValueArray *va)
@@ -174,7 +281,14 @@ uint32_t value_hash(Value value)
   } else if (is_number(value)) {
     return hash_double(as_number(value));
   } else if (is_object(value)) {
-    return as_object(value)->hash;
+    // Only strings keep their hash. Other objects are equal to themselves
+    // alone, so their address does, mixed since objects are 16-byte aligned.
+    Object *obj = as_object(value);
+    if (obj->type == OBJ_STRING) {
+      return ((ObjectString *)obj)->hash;
+    }
+    uint64_t addr = (uint64_t)(uintptr_t)obj >> 4;
+    return (uint32_t)(addr ^ (addr >> 32)) * 2654435761u;
   }
   panic("unknown type of value");
 }
@@ -192,41 +306,32 @@ bool value_truable(Value value)
 
 bool value_equal(Value v1, Value v2)
 {
-  if (v1.type != v2.type)
-    return false;
-  // v1 and v2 have same type now.
-  switch (v1.type) {
-  case VT_NIL:
-    return true;
-  case VT_BOOL:
-    return as_bool(v1) == as_bool(v2);
-  case VT_NUM:
+  if (is_number(v1) && is_number(v2)) {
     return as_number(v1) == as_number(v2);
-  case VT_OBJ:
-    return object_equal(as_object(v1), as_object(v2));
-  default:
-    panic("unknown value type");
   }
+  if (is_object(v1) && is_object(v2)) {
+    // Strings are interned and every other object only equals itself.
+    return as_object(v1) == as_object(v2);
+  }
+  if (is_bool(v1) && is_bool(v2)) {
+    return as_bool(v1) == as_bool(v2);
+  }
+  return is_nil(v1) && is_nil(v2);
 }
 
 void value_print(Value v)
 {
-  switch (v.type) {
-  case VT_NIL:
+  if (is_nil(v)) {
     printf("nil");
-    break;
-  case VT_NUM:
+  } else if (is_number(v)) {
     printf("%g", as_number(v));
-    break;
-  case VT_BOOL:
+  } else if (is_bool(v)) {
     if (as_bool(v) == true) {
       printf("true");
     } else {
       printf("false");
     }
-    break;
-  case VT_OBJ:
+  } else if (is_object(v)) {
     object_print(as_object(v));
-    break;
   }
 }
@@ -12,6 +12,7 @@ typedef enum {
   VT_NUM,
   VT_BOOL,
   VT_OBJ,
+  VT_UNDEF, // a global slot not defined yet, never seen by scripts
 } value_t;
 
 typedef enum {
@@ -25,37 +26,69 @@ typedef enum {
   OBJ_BOUND_METHOD,
 } object_t;
 
+// Object is the header of every heap object. Whatever depends on the type
+// of an object is found through object_vtables, so the header only keeps
+// the type, the size for the allocator and the bits of the collector.
 typedef struct Object {
-  object_t type;
-  uint32_t hash;
+  uint8_t type; // object_t
+
+  // old is set once the object survived a collection. remembered is set
+  // while the object is in the remembered set of the write barrier.
+  bool old : 1;
+  bool remembered : 1;
 
   // size of one object alloc
-  int size;
+  uint32_t size;
+} Object;
+
+// ObjectVtable holds the behavior shared by all objects of a type. Types
+// without a destructor leave it NULL.
+typedef struct {
+  // equal returns whether two objects are equal
+  bool (*equal)(Object *, Object *);
+  // format prints the object
+  void (*format)(Object *);
+  // destructor is called when the object is freed
+  void (*destructor)(Object *);
+} ObjectVtable;
 
-  // marked is used in gc
-  bool marked;
+extern const ObjectVtable object_vtables[];
 
-  // equal points to a function returning whether two objects are equal
-  bool (*equal)(struct Object *, struct Object *);
+void trace_heap(void);
 
-  // format points to a function to print the object
-  void (*format)(struct Object *);
+// The heap has two generations. Objects are allocated young. A minor
+// collection marks only young objects, reachable from the roots or from the
+// old objects in the remembered set, then sweep_young frees the unmarked ones
+// and promotes the rest.
+void sweep_young(void);
 
-  // destructor is called when the object is freed
-  void (*destructor)(struct Object *);
+// A full collection marks everything between heap_start_marking and
+// heap_finish_marking, which sweeps the young generation, then sweeps the
+// old one with heap_sweep. Both phases may be spread over several calls of
+// the collector, while the program runs.
+void heap_start_marking(void);
+void heap_finish_marking(void);
+bool heap_sweeping(void);
 
-  // next is the next object on our object heap
-  struct Object *next;
+// heap_sweep sweeps at most pages pages of old objects and returns whether
+// the sweep is done. The allocator also sweeps pages as it needs them.
+bool heap_sweep(int pages);
 
-} Object;
+// heap_remembered returns the remembered set and stores its size in len.
+Object **heap_remembered(int *len);
 
-void trace_heap(void);
+// gc_fn collects garbage: the young generation, everything, or a slice of a
+// full collection in progress. object_alloc calls the registered collector
+// before an allocation once the young generation or the whole heap outgrows
+// its budget (or before every allocation with STRESS_GC), so whoever
+// registers a collector must keep all live objects reachable from its roots
+// whenever it may allocate. Passing NULL turns collection off.
+typedef enum { GC_MINOR, GC_FULL, GC_SLICE } gc_kind;
+typedef void (*gc_fn)(void *, gc_kind);
 
-void sweep_heap(void);
+void heap_set_collector(gc_fn, void *);
 
-Object *object_alloc(int size, object_t type, uint32_t hash,
-                     bool (*equal_fn)(Object *, Object *),
-                     void (*format)(Object *), void (*destrutor)(Object *));
+Object *object_alloc(int size, object_t type);
 
 void object_free(Object *);
 bool object_equal(Object *, Object *);
@@ -64,6 +97,80 @@ void object_print(Object *);
 #define object_is(obj, t) (obj->type == t)
 #define object_as(obj, t) ((t *)obj)
 
+#ifdef NAN_BOXING
+
+// With NAN_BOXING a Value is packed into a single 64-bit word. A number is
+// stored as its raw IEEE-754 bits. Every other value lives in the payload of a
+// quiet NaN, which real arithmetic never produces: nil/false/true use the low
+// bits as a tag, and objects set the sign bit and keep the pointer in the low
+// 48 bits.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEF 4
+
+#define NIL_VAL ((Value)(QNAN | TAG_NIL))
+#define FALSE_VAL ((Value)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(QNAN | TAG_TRUE))
+#define UNDEF_VAL ((Value)(QNAN | TAG_UNDEF))
+
+static inline double value_to_number(Value value)
+{
+  union {
+    Value bits;
+    double number;
+  } u;
+  u.bits = value;
+  return u.number;
+}
+
+static inline Value number_to_value(double number)
+{
+  union {
+    Value bits;
+    double number;
+  } u;
+  u.number = number;
+  return u.bits;
+}
+
+#define as_bool(value) ((value) == TRUE_VAL)
+#define as_number(value) value_to_number(value)
+#define as_object(value)                                                       \
+  ((Object *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define is_nil(value) ((value) == NIL_VAL)
+#define is_undef(value) ((value) == UNDEF_VAL)
+#define is_number(value) (((value)&QNAN) != QNAN)
+#define is_bool(value) (((value) | 1) == TRUE_VAL)
+#define is_object(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+static inline Value value_make_nil(void) { return NIL_VAL; }
+
+static inline Value value_make_undef(void) { return UNDEF_VAL; }
+
+static inline Value value_make_bool(bool boolean)
+{
+  return boolean ? TRUE_VAL : FALSE_VAL;
+}
+
+static inline Value value_make_number(double number)
+{
+  return number_to_value(number);
+}
+
+static inline Value value_make_object(Object *obj)
+{
+  return (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)obj);
+}
+
+#else
+
 struct Value {
   value_t type;
   union {
@@ -75,31 +182,97 @@ struct Value {
 
 typedef struct Value Value;
 
-#define as_bool(value) (value.as.boolean)
-#define as_number(value) (value.as.number)
-#define as_object(value) (value.as.obj)
+#define as_bool(value) ((value).as.boolean)
+#define as_number(value) ((value).as.number)
+#define as_object(value) ((value).as.obj)
+
+#define is_nil(value) ((value).type == VT_NIL)
+#define is_undef(value) ((value).type == VT_UNDEF)
+#define is_number(value) ((value).type == VT_NUM)
+#define is_bool(value) ((value).type == VT_BOOL)
+#define is_object(value) ((value).type == VT_OBJ)
 
-#define is_nil(value) (value.type == VT_NIL)
-#define is_number(value) (value.type == VT_NUM)
-#define is_bool(value) (value.type == VT_BOOL)
-#define is_object(value) (value.type == VT_OBJ)
+static inline Value value_make_nil(void)
+{
+  Value value;
+  value.type = VT_NIL;
+  return value;
+}
 
-Value value_make_nil(void);
-Value value_make_bool(bool);
-Value value_make_number(double);
-Value value_make_object(Object *);
+static inline Value value_make_undef(void)
+{
+  Value value;
+  value.type = VT_UNDEF;
+  return value;
+}
+
+static inline Value value_make_bool(bool boolean)
+{
+  Value value;
+  value.type = VT_BOOL;
+  value.as.boolean = boolean;
+  return value;
+}
+
+static inline Value value_make_number(double number)
+{
+  Value value;
+  value.type = VT_NUM;
+  value.as.number = number;
+  return value;
+}
+
+static inline Value value_make_object(Object *obj)
+{
+  Value value;
+  value.type = VT_OBJ;
+  value.as.obj = obj;
+  return value;
+}
+
+#endif
 
 uint32_t value_hash(Value);
 bool value_truable(Value);
 bool value_equal(Value, Value);
 void value_print(Value v);
 
+void heap_remember(Object *);
+
+// heap_marking is set while a full collection is marking. heap_shade adds
+// obj to the objects it has yet to mark, and heap_marked returns whether
+// the collector marked it.
+extern bool heap_marking;
+void heap_shade(Object *obj);
+bool heap_marked(Object *obj);
+
+// write_barrier must follow every store of value into owner made after owner
+// was allocated. It remembers old objects that come to reference young ones,
+// so a minor collection sees those references, and shades the objects
+// stored while marking, so marking never misses an object moved behind it.
+static inline void write_barrier(Object *owner, Value value)
+{
+  if (!is_object(value)) {
+    return;
+  }
+  Object *obj = as_object(value);
+  if (owner->old && !owner->remembered && !obj->old) {
+    heap_remember(owner);
+  }
+  if (heap_marking && !heap_marked(obj)) {
+    heap_shade(obj);
+  }
+}
+
 typedef struct {
   int len;
   int cap;
   Value *value;
 } ValueArray;
 
+// heap_gray returns the work set of marking.
+ValueArray *heap_gray(void);
+
 void value_array_init(ValueArray *va);
 void value_array_write(ValueArray *va, Value v);
 void value_array_free(ValueArray *va);
@@ -0,0 +1,573 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "memory.h"
+#include "verify.h"
+
+typedef struct {
+  ObjectFunction *fun;
+  Globals *globals;
+  Chunk *chunk;
+  int offset; // offset of the instruction being verified
+  char errmsg[128];
+} Verifier;
+
+static int verify_error(Verifier *v, char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(v->errmsg, sizeof(v->errmsg), format, ap);
+  va_end(ap);
+  fprintf(stderr, "Bytecode verification failed in %s at %04d: %s\n",
+          v->fun->name->str, v->offset, v->errmsg);
+  return 1;
+}
+
+static int check_operands(Verifier *v, int n)
+{
+  if (v->offset + n >= v->chunk->len) {
+    return verify_error(v, "truncated operand");
+  }
+  return 0;
+}
+
+static inline uint8_t operand(Verifier *v, int n)
+{
+  return v->chunk->code[v->offset + n];
+}
+
+static inline int operand16(Verifier *v, int n)
+{
+  return (operand(v, n) << 8) | operand(v, n + 1);
+}
+
+static int check_constant(Verifier *v, int idx)
+{
+  if (idx >= v->fun->constants.len) {
+    return verify_error(v, "constant %d out of range", idx);
+  }
+  return 0;
+}
+
+static int check_name(Verifier *v, int idx)
+{
+  if (check_constant(v, idx)) {
+    return 1;
+  }
+  if (!is_string(v->fun->constants.value[idx])) {
+    return verify_error(v, "constant %d is not a name", idx);
+  }
+  return 0;
+}
+
+static int check_global(Verifier *v, int n)
+{
+  int slot = operand16(v, n);
+  if (slot >= v->globals->values.len) {
+    return verify_error(v, "global %d out of range", slot);
+  }
+  return 0;
+}
+
+static int check_selector(Verifier *v, int n)
+{
+  int selector = operand16(v, n);
+  if (selector >= selector_count()) {
+    return verify_error(v, "selector %d out of range", selector);
+  }
+  return 0;
+}
+
+static int check_slot(Verifier *v, int slot)
+{
+  if (slot >= v->fun->slot_size) {
+    return verify_error(v, "local slot %d out of range", slot);
+  }
+  return 0;
+}
+
+static int check_upvalue(Verifier *v, int idx)
+{
+  if (idx >= v->fun->upvalue_size) {
+    return verify_error(v, "upvalue %d out of range", idx);
+  }
+  return 0;
+}
+
+static int check_ic(Verifier *v, int n)
+{
+  int idx = operand16(v, n);
+  if (idx >= v->fun->ic_size) {
+    return verify_error(v, "inline cache %d out of range", idx);
+  }
+  return 0;
+}
+
+// jmp_distance returns the distance of the jump at v->offset, whose
+// instruction is len bytes long and ends with the distance.
+static inline int jmp_distance(Verifier *v, int len)
+{
+  return (operand(v, len - 2) << 8) | operand(v, len - 1);
+}
+
+// check_register checks the operands of a register instruction: n local
+// slots, then a constant if constant is set, else one more local slot.
+static int check_register(Verifier *v, int n, bool constant)
+{
+  if (check_operands(v, n + 1)) {
+    return 1;
+  }
+  for (int i = 1; i <= n; i++) {
+    if (check_slot(v, operand(v, i))) {
+      return 1;
+    }
+  }
+  return constant ? check_constant(v, operand(v, n + 1))
+                  : check_slot(v, operand(v, n + 1));
+}
+
+// instruction_len verifies the instruction at v->offset and returns its
+// length in bytes, or -1 if it is invalid. Jump targets are checked once all
+// instruction boundaries are known.
+static int instruction_len(Verifier *v)
+{
+  switch (v->chunk->code[v->offset]) {
+  case OP_RETURN:
+  case OP_NEGATIVE:
+  case OP_NOT:
+  case OP_MINUS:
+  case OP_ADD:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_BANG_EQUAL:
+  case OP_EQUAL_EQUAL:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS:
+  case OP_LESS_EQUAL:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_CLOSE:
+  case OP_DERIVE:
+  case OP_END_CLASS:
+    return 1;
+
+  case OP_CONSTANT:
+    return check_operands(v, 1) || check_constant(v, operand(v, 1)) ? -1 : 2;
+
+  case OP_CONSTANT_LONG:
+    return check_operands(v, 2) || check_constant(v, operand16(v, 1)) ? -1 : 3;
+
+  case OP_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_GLOBAL:
+    return check_operands(v, 2) || check_global(v, 1) ? -1 : 3;
+
+  case OP_CLASS:
+    return check_operands(v, 2) || check_name(v, operand16(v, 1)) ? -1 : 3;
+
+  case OP_METHOD:
+  case OP_GET_SUPER:
+    return check_operands(v, 2) || check_selector(v, 1) ? -1 : 3;
+
+  case OP_GET_FIELD:
+  case OP_SET_FIELD:
+    return check_operands(v, 4) || check_name(v, operand16(v, 1))
+                   || check_ic(v, 3)
+               ? -1
+               : 5;
+
+  case OP_SET_LOCAL:
+  case OP_GET_LOCAL:
+    return check_operands(v, 1) || check_slot(v, operand(v, 1)) ? -1 : 2;
+
+  case OP_SET_UPVALUE:
+  case OP_GET_UPVALUE:
+    return check_operands(v, 1) || check_upvalue(v, operand(v, 1)) ? -1 : 2;
+
+  case OP_CALL:
+    return check_operands(v, 1) ? -1 : 2;
+
+  case OP_INVOKE:
+    return check_operands(v, 5) || check_selector(v, 2) || check_ic(v, 4)
+               ? -1
+               : 6;
+
+  case OP_JMP:
+  case OP_JMP_BACK:
+  case OP_JMP_ON_FALSE:
+  case OP_JMP_UNLESS_EQUAL:
+  case OP_JMP_UNLESS_GREATER:
+  case OP_JMP_UNLESS_GREATER_EQUAL:
+  case OP_JMP_UNLESS_LESS:
+  case OP_JMP_UNLESS_LESS_EQUAL:
+    return check_operands(v, 2) ? -1 : 3;
+
+  case OP_GET_LOCAL_GET_FIELD:
+    return check_operands(v, 5) || check_slot(v, operand(v, 1))
+                   || check_name(v, operand16(v, 2)) || check_ic(v, 4)
+               ? -1
+               : 6;
+
+  case OP_ADD_CONST:
+    return check_operands(v, 1) || check_constant(v, operand(v, 1)) ? -1 : 2;
+
+  case OP_SET_LOCAL_POP:
+    return check_operands(v, 1) || check_slot(v, operand(v, 1)) ? -1 : 2;
+
+  case OP_ADD_LL:
+  case OP_MINUS_LL:
+  case OP_MUL_LL:
+  case OP_DIV_LL:
+  case OP_MOVE:
+    return check_register(v, 1, false) ? -1 : 3;
+
+  case OP_ADD_LC:
+  case OP_MINUS_LC:
+  case OP_MUL_LC:
+  case OP_DIV_LC:
+  case OP_LOAD_CONST:
+    return check_register(v, 1, true) ? -1 : 3;
+
+  case OP_ADD_LL_TO:
+  case OP_MINUS_LL_TO:
+  case OP_MUL_LL_TO:
+  case OP_DIV_LL_TO:
+    return check_register(v, 2, false) ? -1 : 4;
+
+  case OP_ADD_LC_TO:
+  case OP_MINUS_LC_TO:
+  case OP_MUL_LC_TO:
+  case OP_DIV_LC_TO:
+    return check_register(v, 2, true) ? -1 : 4;
+
+  case OP_JMP_UNLESS_EQUAL_LL:
+  case OP_JMP_UNLESS_GREATER_LL:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LL:
+  case OP_JMP_UNLESS_LESS_LL:
+  case OP_JMP_UNLESS_LESS_EQUAL_LL:
+    return check_register(v, 1, false) || check_operands(v, 4) ? -1 : 5;
+
+  case OP_JMP_UNLESS_EQUAL_LC:
+  case OP_JMP_UNLESS_GREATER_LC:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LC:
+  case OP_JMP_UNLESS_LESS_LC:
+  case OP_JMP_UNLESS_LESS_EQUAL_LC:
+    return check_register(v, 1, true) || check_operands(v, 4) ? -1 : 5;
+
+  case OP_CLOSURE: {
+    if (check_operands(v, 2) || check_constant(v, operand16(v, 1))) {
+      return -1;
+    }
+    Value proto = v->fun->constants.value[operand16(v, 1)];
+    if (!is_fun(proto)) {
+      verify_error(v, "constant %d is not a function", operand16(v, 1));
+      return -1;
+    }
+    int upvalue_size = as_function(proto)->upvalue_size;
+    if (upvalue_size > 0 && check_operands(v, 2 + upvalue_size * 2)) {
+      return -1;
+    }
+    for (int i = 0; i < upvalue_size; i++) {
+      int idx = operand(v, 3 + i * 2);
+      int from_local = operand(v, 4 + i * 2);
+      if (from_local > 1) {
+        verify_error(v, "bad upvalue descriptor %d", i);
+        return -1;
+      }
+      if (from_local ? check_slot(v, idx) : check_upvalue(v, idx)) {
+        return -1;
+      }
+    }
+    return 3 + upvalue_size * 2;
+  }
+
+  default:
+    verify_error(v, "unknown opcode %d", v->chunk->code[v->offset]);
+    return -1;
+  }
+}
+
+// jmp_target sets *target to the offset the jump at v->offset lands on. It
+// returns false if the instruction is not a jump.
+static bool jmp_target(Verifier *v, int *target)
+{
+  switch (v->chunk->code[v->offset]) {
+  case OP_JMP:
+  case OP_JMP_ON_FALSE:
+  case OP_JMP_UNLESS_EQUAL:
+  case OP_JMP_UNLESS_GREATER:
+  case OP_JMP_UNLESS_GREATER_EQUAL:
+  case OP_JMP_UNLESS_LESS:
+  case OP_JMP_UNLESS_LESS_EQUAL:
+    *target = v->offset + 3 + jmp_distance(v, 3);
+    return true;
+  case OP_JMP_UNLESS_EQUAL_LL:
+  case OP_JMP_UNLESS_EQUAL_LC:
+  case OP_JMP_UNLESS_GREATER_LL:
+  case OP_JMP_UNLESS_GREATER_LC:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LL:
+  case OP_JMP_UNLESS_GREATER_EQUAL_LC:
+  case OP_JMP_UNLESS_LESS_LL:
+  case OP_JMP_UNLESS_LESS_LC:
+  case OP_JMP_UNLESS_LESS_EQUAL_LL:
+  case OP_JMP_UNLESS_LESS_EQUAL_LC:
+    *target = v->offset + 5 + jmp_distance(v, 5);
+    return true;
+  case OP_JMP_BACK:
+    *target = v->offset + 3 - jmp_distance(v, 3);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// check_jmp checks that the jump at v->offset lands on an instruction
+// boundary within the chunk.
+static int check_jmp(Verifier *v, bool *starts)
+{
+  int target;
+  if (!jmp_target(v, &target)) {
+    return 0;
+  }
+  if (target < 0 || target >= v->chunk->len || !starts[target]) {
+    return verify_error(v, "bad jump target %04d", target);
+  }
+  return 0;
+}
+
+// stack_effect sets *pops and *pushes to the number of values the
+// instruction at v->offset takes from and leaves on the stack, and *peak to
+// the most values it has pushed at once on its way. Calls are counted here
+// only for their arguments and result: the callee checks its own frame.
+static void stack_effect(Verifier *v, int *pops, int *pushes, int *peak)
+{
+  *pops = 0;
+  *pushes = 0;
+  *peak = 0;
+  switch (v->chunk->code[v->offset]) {
+  case OP_RETURN:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_CLOSE:
+  case OP_GLOBAL:
+  case OP_METHOD:
+  case OP_END_CLASS:
+  case OP_SET_LOCAL_POP:
+    *pops = 1;
+    break;
+
+  case OP_NEGATIVE:
+  case OP_NOT:
+  case OP_SET_GLOBAL:
+  case OP_SET_LOCAL:
+  case OP_SET_UPVALUE:
+  case OP_GET_FIELD:
+  case OP_JMP_ON_FALSE:
+    *pops = 1;
+    *pushes = 1;
+    break;
+
+  case OP_ADD_CONST:
+    // strings are concatenated on the stack
+    *pops = 1;
+    *pushes = 1;
+    *peak = 1;
+    break;
+
+  case OP_MINUS:
+  case OP_ADD:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_BANG_EQUAL:
+  case OP_EQUAL_EQUAL:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS:
+  case OP_LESS_EQUAL:
+  case OP_SET_FIELD:
+  case OP_GET_SUPER:
+    *pops = 2;
+    *pushes = 1;
+    break;
+
+  case OP_DERIVE:
+    *pops = 2;
+    *pushes = 2;
+    break;
+
+  case OP_JMP_UNLESS_EQUAL:
+  case OP_JMP_UNLESS_GREATER:
+  case OP_JMP_UNLESS_GREATER_EQUAL:
+  case OP_JMP_UNLESS_LESS:
+  case OP_JMP_UNLESS_LESS_EQUAL:
+    *pops = 2;
+    break;
+
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CLASS:
+  case OP_GET_LOCAL_GET_FIELD:
+  case OP_MINUS_LL:
+  case OP_MINUS_LC:
+  case OP_MUL_LL:
+  case OP_MUL_LC:
+  case OP_DIV_LL:
+  case OP_DIV_LC:
+    *pushes = 1;
+    break;
+
+  case OP_ADD_LL:
+  case OP_ADD_LC:
+    // strings are concatenated on the stack
+    *pushes = 1;
+    *peak = 2;
+    break;
+
+  case OP_ADD_LL_TO:
+  case OP_ADD_LC_TO:
+    *peak = 2;
+    break;
+
+  case OP_CALL:
+  case OP_INVOKE:
+    *pops = operand(v, 1) + 1;
+    *pushes = 1;
+    break;
+
+  default:
+    break;
+  }
+  if (*pushes - *pops > *peak) {
+    *peak = *pushes - *pops;
+  }
+}
+
+// flow_to records that the stack holds depth values when execution reaches
+// target, which must agree with every other path reaching it.
+static int flow_to(Verifier *v, int *depths, int *work, int *n, int target,
+                   int depth)
+{
+  if (depths[target] < 0) {
+    depths[target] = depth;
+    work[(*n)++] = target;
+  } else if (depths[target] != depth) {
+    return verify_error(v, "stack depth %d at %04d, expected %d", depth,
+                        target, depths[target]);
+  }
+  return 0;
+}
+
+// check_stack follows every path from the entry of the chunk, checks that it
+// never pops more than it pushed and sets fun->stack_size to the deepest the
+// stack of a frame running it gets. The frame starts with the callee and its
+// arguments.
+static int check_stack(Verifier *v)
+{
+  int len = v->chunk->len;
+  int *depths = grow_array(int, NULL, 0, len);
+  int *work = grow_array(int, NULL, 0, len);
+  for (int i = 0; i < len; i++) {
+    depths[i] = -1;
+  }
+
+  int err = 0;
+  int n = 0;
+  int max = v->fun->arity + 1;
+  depths[0] = max;
+  work[n++] = 0;
+  while (n > 0) {
+    v->offset = work[--n];
+    int depth = depths[v->offset];
+    int pops, pushes, peak;
+    stack_effect(v, &pops, &pushes, &peak);
+    if (depth < pops) {
+      err = verify_error(v, "stack underflow");
+      goto out;
+    }
+    if (depth + peak > max) {
+      max = depth + peak;
+    }
+    depth += pushes - pops;
+
+    uint8_t op = v->chunk->code[v->offset];
+    int target;
+    if (jmp_target(v, &target)
+        && flow_to(v, depths, work, &n, target, depth)) {
+      err = 1;
+      goto out;
+    }
+    if (op != OP_RETURN && op != OP_JMP && op != OP_JMP_BACK
+        && flow_to(v, depths, work, &n, v->offset + instruction_len(v),
+                   depth)) {
+      err = 1;
+      goto out;
+    }
+  }
+  v->fun->stack_size = max > v->fun->slot_size ? max : v->fun->slot_size;
+
+out:
+  free_array(int, depths, len);
+  free_array(int, work, len);
+  return err;
+}
+
+int verify(ObjectFunction *fun, Globals *globals)
+{
+  Verifier v;
+  v.fun = fun;
+  v.globals = globals;
+  v.chunk = &fun->chunk;
+  v.offset = 0;
+
+  if (v.chunk->len == 0) {
+    return verify_error(&v, "empty chunk");
+  }
+
+  int err = 0;
+  bool *starts = grow_array(bool, NULL, 0, v.chunk->len);
+  for (int i = 0; i < v.chunk->len; i++) {
+    starts[i] = false;
+  }
+
+  int last = 0;
+  while (v.offset < v.chunk->len) {
+    int len = instruction_len(&v);
+    if (len < 0) {
+      err = 1;
+      goto out;
+    }
+    starts[v.offset] = true;
+    last = v.offset;
+    v.offset += len;
+  }
+
+  // Execution must not be able to fall off the end of the chunk.
+  v.offset = last;
+  switch (v.chunk->code[last]) {
+  case OP_RETURN:
+  case OP_JMP:
+  case OP_JMP_BACK:
+    break;
+  default:
+    err = verify_error(&v, "chunk does not end with a return");
+    goto out;
+  }
+
+  for (v.offset = 0; v.offset < v.chunk->len; v.offset++) {
+    if (starts[v.offset] && check_jmp(&v, starts)) {
+      err = 1;
+      goto out;
+    }
+  }
+
+  err = check_stack(&v);
+
+out:
+  free_array(bool, starts, v.chunk->len);
+  return err;
+}
@@ -0,0 +1,14 @@
+#ifndef clox_verify_h
+#define clox_verify_h
+
+#include "globals.h"
+#include "object.h"
+#include "value.h"
+
+// verify checks that the bytecode of a compiled function is well formed, so
+// the interpreter can fetch instructions and operands without bounds checks.
+// It returns 0 if the function is valid, else it reports the problem to
+// stderr and returns 1.
+int verify(ObjectFunction *, Globals *);
+
+#endif
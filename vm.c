@@ -2,10 +2,13 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "debug.h"
 #include "map.h"
 #include "memory.h"
+#include "shape.h"
+#include "slab.h"
 #include "vm.h"
 
 void vm_error(VM *vm, char *errmsg);
@@ -13,60 +16,76 @@ void vm_errorf(VM *vm, char *format, ...);
 
 uint8_t fetch_code(VM *vm);
 Value fetch_constant(VM *vm);
-int fetch_int16(VM *vm);
-void run_instruction(VM *vm, uint8_t i);
-
-void op_constant(VM *vm);
-void op_negative(VM *vm);
-void op_not(VM *vm);
-void op_binary(VM *vm, uint8_t op);
-void op_global(VM *vm);
-void op_set_global(VM *vm);
-void op_get_global(VM *vm);
-void op_set_local(VM *vm);
-void op_get_local(VM *vm);
-void op_set_upvalue(VM *vm);
-void op_get_upvalue(VM *vm);
-void op_jmp(VM *vm);
-void op_jmp_back(VM *vm);
-void op_jmp_on_false(VM *vm);
-void op_call(VM *vm);
+
+void op_concat(VM *vm);
 void op_closure(VM *vm);
 void op_class(VM *vm);
-void op_get_filed(VM *vm);
-void op_set_filed(VM *vm);
 void op_method(VM *vm);
-void op_invoke(VM *vm);
 void op_derive(VM *vm);
 void op_get_super(VM *vm);
-void op_return(VM *vm);
-void op_print(VM *vm);
+void op_end_class(VM *vm);
+
 
-static Map *globals(VM *vm);
+static void call_fun(VM *vm, int arity, ObjectClosure *callee);
+static void call_value(VM *vm, int arity, Value value);
+static void get_property(VM *vm, Value name, InlineCache *ic);
+static void set_property(ObjectInstance *ins, Value name, Value value,
+                         InlineCache *ic);
+static void invoke(VM *vm, int selector, int arity, InlineCache *ic);
+static void run(VM *vm);
 
-static void vm_gc(VM *vm);
+static void vm_gc(VM *vm, gc_kind kind);
+static void vm_collect(void *vm, gc_kind kind);
+static void vm_gc_finish(VM *vm);
 static void vm_debug(VM *vm);
 
+// Chunks are checked by the bytecode verifier after they are compiled, so
+// instructions and operands are fetched without bounds checks. Build with
+// CHECKED_FETCH (implied by DEBUG_RUNTIME) to check every fetch anyway.
+#if defined(DEBUG_RUNTIME) && !defined(CHECKED_FETCH)
+#define CHECKED_FETCH
+#endif
+
+static char *global_name(VM *vm, int slot)
+{
+  return as_string(vm->globals.names.value[slot])->str;
+}
+
 static void define_native(VM *vm, char *name, int arity, native_fn method)
 {
   Value native = value_make_native(arity, method);
-  map_put(&vm->globals, value_make_string(name, strlen(name)), native);
+  int slot = globals_slot(&vm->globals, value_make_string(name, strlen(name)));
+  vm->globals.values.value[slot] = native;
 }
 
+const NativeDef vm_natives[] = {
+  { "clock", 0, native_clock },
+};
+
+const int vm_native_count = sizeof(vm_natives) / sizeof(vm_natives[0]);
+
 void vm_init(VM *vm)
 {
   vm->sp = vm->stack - 1;
   vm->error = 0;
   vm->vmain = value_make_fun(0, as_string(value_make_string("script", 6)));
 
-  value_array_init(&vm->constants);
-  value_array_write(&vm->constants, value_make_object(string_copy("init", 4)));
-
-  map_init(&vm->globals);
+  value_array_init(&vm->functions);
 
-  vm->gc_threshold = 1024 * 1024;
+  globals_init(&vm->globals);
+  vm->profile = NULL;
+  memset(&vm->gc_stats, 0, sizeof(vm->gc_stats));
+#ifdef STRESS_GC
+  // Take full collections in the smallest slices, to exercise the barrier.
+  vm->gc_pause = 1;
+#else
+  vm->gc_pause = 0;
+#endif
 
-  define_native(vm, "clock", 0, native_clock);
+  for (int i = 0; i < vm_native_count; i++) {
+    define_native(vm, vm_natives[i].name, vm_natives[i].arity,
+                  vm_natives[i].method);
+  }
 }
 
 void vm_push(VM *vm, Value v)
@@ -149,12 +168,12 @@ static inline void frame_push(VM *vm, ObjectClosure *closure)
   vm->frames[vm->cur_frame].bp = vm->sp - closure->proto->arity;
 }
 
-static inline void frame_pop(VM *vm)
+// frame_fits reports whether the value stack has room for a frame running
+// closure, whose callee and arguments are on top of the stack.
+static inline bool frame_fits(VM *vm, ObjectClosure *closure)
 {
-  vm->sp = cur_frame(vm)->bp;
-  close_upvalue(vm, vm->sp);
-  vm_pop(vm);
-  vm->cur_frame--;
+  ObjectFunction *proto = closure->proto;
+  return (vm->sp - vm->stack) - proto->arity + proto->stack_size <= STACK_MAX;
 }
 
 void vm_run(VM *vm)
@@ -163,368 +182,956 @@ void vm_run(VM *vm)
   vm->cur_frame = -1;
   vm->main_closure = as_closure(value_make_closure(as_function(vm->vmain)));
   vm_push(vm, vm->vmain);
+  if (!frame_fits(vm, vm->main_closure)) {
+    vm_errorf(vm, "Stack overflow.");
+    return;
+  }
   frame_push(vm, vm->main_closure);
-  while (1) {
 
-#define GC_HEAP_GROW_FACTOR 2
+  // Collection is only enabled while the program runs: objects created by
+  // the compiler are not reachable from the vm roots yet.
+  heap_set_collector(vm_collect, vm);
+  if (vm->profile != NULL) {
+    profile_start(vm->profile);
+  }
+  run(vm);
+  if (vm->profile != NULL) {
+    profile_stop(vm->profile);
+  }
+  vm_gc_finish(vm);
+  heap_set_collector(NULL, NULL);
+}
+
+#ifdef CHECKED_FETCH
+static uint8_t fetch_overflow(void) { panic("VM error: fetch_code overflow"); }
+#endif
 
-    if (mem_alloc() >= vm->gc_threshold) {
-      vm_gc(vm);
-      vm->gc_threshold = mem_alloc() * GC_HEAP_GROW_FACTOR;
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// ic_find returns the entry of the inline cache for instances of shape, or
+// NULL if there is none. A megamorphic cache never hits.
+static inline ICEntry *ic_find(InlineCache *ic, Shape *shape)
+{
+  for (int i = 0; i < ic->len; i++) {
+    if (ic->entries[i].shape == shape) {
+      return &ic->entries[i];
     }
+  }
+  return NULL;
+}
+
+// ic_update records the result of a lookup on an instance of shape. Once the
+// cache has no room for another shape it goes megamorphic and is cleared.
+// Dictionary shapes are never cached, so a hit always means the instance has
+// its fields in slots.
+static void ic_update(InlineCache *ic, Shape *shape, int slot, Shape *next,
+                      Value method)
+{
+  if (ic->megamorphic || shape->dictionary) {
+    return;
+  }
+  ICEntry *entry = ic_find(ic, shape);
+  if (entry == NULL) {
+    if (ic->len == IC_WAYS) {
+      ic->megamorphic = true;
+      ic->len = 0;
+      return;
+    }
+    entry = &ic->entries[ic->len++];
+    entry->shape = shape;
+  }
+  entry->slot = slot;
+  entry->next = next;
+  entry->method = method;
+}
+
+// run is the interpreter loop. The state of the running frame is cached in
+// locals so the compiler can keep it in registers:
+//
+//   frame  the running call frame
+//   code   first byte of the running chunk
+//   ics    inline caches of the running function
+//   end    one past the last byte of the running chunk (CHECKED_FETCH only)
+//   ip     next byte to execute
+//   bp     base pointer of the running frame
+//   sp     stack pointer
+//
+// Hot instructions are executed inline on these locals. Everything else goes
+// through an out-of-line handler which works on vm->sp and the frame's pc, so
+// the cached state is written back before and reloaded after such a call.
+//
+// The write-back is also the safepoint protocol of the garbage collector:
+// object_alloc may collect, and collection reads the roots from vm->sp and
+// the frames. Objects are only ever allocated from out-of-line handlers,
+// which in turn keep every object they create reachable (usually on the
+// stack) before allocating the next one.
+//
+// Property accesses go through the inline cache named by their operand, see
+// ic_find.
+//
+// With GCC-compatible compilers dispatch is threaded through a table of label
+// addresses; elsewhere (or with -DNO_COMPUTED_GOTO) it falls back to a switch.
+static void run(VM *vm)
+{
+  CallFrame *frame;
+  uint8_t *code;
+  InlineCache *ics;
+#ifdef CHECKED_FETCH
+  uint8_t *end;
+#endif
+  uint8_t *ip;
+  Value *bp;
+  Value *sp;
+  Value *constants;
+
+#define save_state() (frame->pc = (int)(ip - code), vm->sp = sp)
+
+#ifdef CHECKED_FETCH
+#define load_chunk_end() (end = code + frame->closure->proto->chunk.len)
+#define read_byte() (ip < end ? *ip++ : fetch_overflow())
+#define read_int16()                                                           \
+  (ip += 2, ip <= end ? (ip[-2] << 8) | ip[-1] : fetch_overflow())
+#else
+#define load_chunk_end()
+#define read_byte() (*ip++)
+#define read_int16() (ip += 2, (ip[-2] << 8) | ip[-1])
+#endif
+
+#define load_state()                                                           \
+  do {                                                                         \
+    frame = cur_frame(vm);                                                     \
+    code = frame->closure->proto->chunk.code;                                  \
+    ics = frame->closure->proto->ics;                                          \
+    constants = frame->closure->proto->constants.value;                        \
+    load_chunk_end();                                                          \
+    ip = code + frame->pc;                                                     \
+    bp = frame->bp;                                                            \
+    sp = vm->sp;                                                               \
+  } while (0)
+#define read_constant() (constants[read_byte()])
+#define read_constant_long() (constants[read_int16()])
+
+#define push(v) (*++sp = (v))
+#define pop() (*sp--)
+#define peek(n) (sp[-(n)])
+
+// runtime_error reports an error at the current instruction and leaves the
+// interpreter loop.
+#define runtime_error(...)                                                     \
+  do {                                                                         \
+    save_state();                                                              \
+    vm_errorf(vm, __VA_ARGS__);                                                \
+    return;                                                                    \
+  } while (0)
+
+// call_frame runs a handler which may push or pop call frames.
+#define call_frame(handler)                                                    \
+  do {                                                                         \
+    save_state();                                                              \
+    handler;                                                                   \
+    if (vm->error) {                                                           \
+      return;                                                                  \
+    }                                                                          \
+    load_state();                                                              \
+  } while (0)
+
+// slow_path runs a handler which may allocate.
+#define slow_path(handler)                                                     \
+  do {                                                                         \
+    save_state();                                                              \
+    handler;                                                                   \
+    if (vm->error) {                                                           \
+      return;                                                                  \
+    }                                                                          \
+    load_state();                                                              \
+  } while (0)
+
+#define binary_op(make, op)                                                    \
+  do {                                                                         \
+    Value v2 = peek(0);                                                        \
+    Value v1 = peek(1);                                                        \
+    if (!is_number(v1) || !is_number(v2)) {                                    \
+      runtime_error("Operands must be numbers.");                              \
+    }                                                                          \
+    sp--;                                                                      \
+    *sp = make(as_number(v1) op as_number(v2));                                \
+  } while (0)
+
+// compare_jmp pops two numbers and jumps unless they compare true.
+#define compare_jmp(op)                                                        \
+  do {                                                                         \
+    Value v2 = peek(0);                                                        \
+    Value v1 = peek(1);                                                        \
+    if (!is_number(v1) || !is_number(v2)) {                                    \
+      runtime_error("Operands must be numbers.");                              \
+    }                                                                          \
+    sp -= 2;                                                                   \
+    int offset = read_int16();                                                 \
+    if (!(as_number(v1) op as_number(v2))) {                                   \
+      ip += offset;                                                            \
+    }                                                                          \
+  } while (0)
+
+// The operands of register instructions: a local slot, then a local slot
+// or a constant.
+#define read_local() (bp[read_byte()])
+
+// register_arith computes local a op second for the register forms of
+// MINUS, MUL and DIV, and stores the result in local dst if to is set, else
+// pushes it.
+#define register_arith(op, second, to)                                        \
+  do {                                                                         \
+    Value *dst = (to) ? &read_local() : NULL;                                  \
+    Value v1 = read_local();                                                   \
+    Value v2 = second;                                                         \
+    if (!is_number(v1) || !is_number(v2)) {                                    \
+      runtime_error("Operands must be numbers.");                              \
+    }                                                                          \
+    Value result = value_make_number(as_number(v1) op as_number(v2));          \
+    if (to) {                                                                  \
+      *dst = result;                                                           \
+    } else {                                                                   \
+      push(result);                                                            \
+    }                                                                          \
+  } while (0)
+
+// register_add is register_arith for ADD, which also concatenates strings.
+#define register_add(second, to)                                               \
+  do {                                                                         \
+    Value *dst = (to) ? &read_local() : NULL;                                  \
+    Value v1 = read_local();                                                   \
+    Value v2 = second;                                                         \
+    if (is_number(v1) && is_number(v2)) {                                      \
+      Value result = value_make_number(as_number(v1) + as_number(v2));         \
+      if (to) {                                                                \
+        *dst = result;                                                         \
+      } else {                                                                 \
+        push(result);                                                          \
+      }                                                                        \
+    } else if (is_string(v1) && is_string(v2)) {                               \
+      push(v1);                                                                \
+      push(v2);                                                                \
+      slow_path(op_concat(vm));                                                \
+      if (to) {                                                                \
+        *dst = pop();                                                          \
+      }                                                                        \
+    } else {                                                                   \
+      runtime_error("Operands must be two numbers or two strings.");           \
+    }                                                                          \
+  } while (0)
+
+// register_compare_jmp jumps unless local a and second are numbers which
+// compare true.
+#define register_compare_jmp(op, second)                                       \
+  do {                                                                         \
+    Value v1 = read_local();                                                   \
+    Value v2 = second;                                                         \
+    int offset = read_int16();                                                 \
+    if (!is_number(v1) || !is_number(v2)) {                                    \
+      runtime_error("Operands must be numbers.");                              \
+    }                                                                          \
+    if (!(as_number(v1) op as_number(v2))) {                                   \
+      ip += offset;                                                            \
+    }                                                                          \
+  } while (0)
 
 #ifdef DEBUG_RUNTIME
-    vm_debug(vm);
+#define debug_hook() (save_state(), vm_debug(vm))
+#else
+#define debug_hook()
 #endif
 
-#ifdef DEBUG_GC
-    vm_gc(vm);
+#ifdef COMPUTED_GOTO
+  static void *dispatch_table[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX] = &&L_unknown,
+#define label(op) [op] = &&L_##op
+    label(OP_RETURN),        label(OP_CONSTANT),      label(OP_NEGATIVE),
+    label(OP_CONSTANT_LONG),
+    label(OP_NOT),           label(OP_MINUS),         label(OP_ADD),
+    label(OP_MUL),           label(OP_DIV),           label(OP_BANG_EQUAL),
+    label(OP_EQUAL_EQUAL),   label(OP_GREATER),       label(OP_GREATER_EQUAL),
+    label(OP_LESS),          label(OP_LESS_EQUAL),    label(OP_PRINT),
+    label(OP_POP),           label(OP_CLOSE),         label(OP_GLOBAL),
+    label(OP_SET_GLOBAL),    label(OP_GET_GLOBAL),    label(OP_SET_LOCAL),
+    label(OP_GET_LOCAL),     label(OP_SET_UPVALUE),   label(OP_GET_UPVALUE),
+    label(OP_JMP),           label(OP_JMP_BACK),      label(OP_JMP_ON_FALSE),
+    label(OP_CLOSURE),       label(OP_CALL),          label(OP_CLASS),
+    label(OP_GET_FIELD),     label(OP_SET_FIELD),     label(OP_METHOD),
+    label(OP_INVOKE),        label(OP_DERIVE),        label(OP_GET_SUPER),
+    label(OP_END_CLASS),
+    label(OP_GET_LOCAL_GET_FIELD),
+    label(OP_ADD_CONST),
+    label(OP_SET_LOCAL_POP),
+    label(OP_JMP_UNLESS_EQUAL),
+    label(OP_JMP_UNLESS_GREATER),
+    label(OP_JMP_UNLESS_GREATER_EQUAL),
+    label(OP_JMP_UNLESS_LESS),
+    label(OP_JMP_UNLESS_LESS_EQUAL),
+    label(OP_ADD_LL),        label(OP_ADD_LC),        label(OP_ADD_LL_TO),
+    label(OP_ADD_LC_TO),     label(OP_MINUS_LL),      label(OP_MINUS_LC),
+    label(OP_MINUS_LL_TO),   label(OP_MINUS_LC_TO),   label(OP_MUL_LL),
+    label(OP_MUL_LC),        label(OP_MUL_LL_TO),     label(OP_MUL_LC_TO),
+    label(OP_DIV_LL),        label(OP_DIV_LC),        label(OP_DIV_LL_TO),
+    label(OP_DIV_LC_TO),
+    label(OP_JMP_UNLESS_EQUAL_LL),
+    label(OP_JMP_UNLESS_EQUAL_LC),
+    label(OP_JMP_UNLESS_GREATER_LL),
+    label(OP_JMP_UNLESS_GREATER_LC),
+    label(OP_JMP_UNLESS_GREATER_EQUAL_LL),
+    label(OP_JMP_UNLESS_GREATER_EQUAL_LC),
+    label(OP_JMP_UNLESS_LESS_LL),
+    label(OP_JMP_UNLESS_LESS_LC),
+    label(OP_JMP_UNLESS_LESS_EQUAL_LL),
+    label(OP_JMP_UNLESS_LESS_EQUAL_LC),
+    label(OP_MOVE),          label(OP_LOAD_CONST),
+#undef label
+  };
+  // While profiling every opcode is dispatched through L_profile first, so
+  // the profiler costs nothing when it is off.
+  static void *profile_table[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX] = &&L_profile,
+  };
+  void **table = vm->profile != NULL ? profile_table : dispatch_table;
+#define vm_case(op) L_##op
+#define vm_default L_unknown
+#define dispatch()                                                             \
+  do {                                                                         \
+    debug_hook();                                                              \
+    goto *table[read_byte()];                                                  \
+  } while (0)
+#else
+  uint8_t op;
+#define vm_case(op) case op
+#define vm_default default
+#define dispatch() goto next
+#endif
+
+  load_state();
+
+#ifdef COMPUTED_GOTO
+  dispatch();
+L_profile:
+  profile_record(vm->profile, frame->closure->proto, ip[-1]);
+  goto *dispatch_table[ip[-1]];
+#else
+next:
+  debug_hook();
+  op = read_byte();
+  if (vm->profile != NULL) {
+    profile_record(vm->profile, frame->closure->proto, op);
+  }
+  switch (op)
 #endif
+  {
+  vm_case(OP_CONSTANT) : {
+    push(read_constant());
+    dispatch();
+  }
+
+  vm_case(OP_CONSTANT_LONG) : {
+    push(read_constant_long());
+    dispatch();
+  }
 
-    if (cur_frame(vm)->pc >= cur_chunk(vm)->len) {
-      vm_error(vm, "VM error: pc out of bound");
+  vm_case(OP_NEGATIVE) : {
+    if (!is_number(peek(0))) {
+      runtime_error("Operand must be a number.");
     }
-    if (vm->error) {
-      while (fetch_code(vm) != OP_RETURN)
-        ;
-      return;
+    *sp = value_make_number(-as_number(peek(0)));
+    dispatch();
+  }
+
+  vm_case(OP_NOT) : {
+    *sp = value_make_bool(!value_truable(peek(0)));
+    dispatch();
+  }
+
+  vm_case(OP_ADD) : {
+    Value v2 = peek(0);
+    Value v1 = peek(1);
+    if (is_number(v1) && is_number(v2)) {
+      sp--;
+      *sp = value_make_number(as_number(v1) + as_number(v2));
+    } else if (is_string(v1) && is_string(v2)) {
+      slow_path(op_concat(vm));
+    } else {
+      runtime_error("Operands must be two numbers or two strings.");
     }
-    uint8_t instruction = fetch_code(vm);
-    run_instruction(vm, instruction);
-    if (vm->done) {
-      return;
+    dispatch();
+  }
+
+  vm_case(OP_MINUS) : {
+    binary_op(value_make_number, -);
+    dispatch();
+  }
+
+  vm_case(OP_MUL) : {
+    binary_op(value_make_number, *);
+    dispatch();
+  }
+
+  vm_case(OP_DIV) : {
+    binary_op(value_make_number, /);
+    dispatch();
+  }
+
+  // comparision '!=' '==' work on all value
+  vm_case(OP_BANG_EQUAL) : {
+    Value v2 = pop();
+    *sp = value_make_bool(!value_equal(peek(0), v2));
+    dispatch();
+  }
+
+  vm_case(OP_EQUAL_EQUAL) : {
+    Value v2 = pop();
+    *sp = value_make_bool(value_equal(peek(0), v2));
+    dispatch();
+  }
+
+  // comparision on numbers
+  vm_case(OP_GREATER) : {
+    binary_op(value_make_bool, >);
+    dispatch();
+  }
+
+  vm_case(OP_GREATER_EQUAL) : {
+    binary_op(value_make_bool, >=);
+    dispatch();
+  }
+
+  vm_case(OP_LESS) : {
+    binary_op(value_make_bool, <);
+    dispatch();
+  }
+
+  vm_case(OP_LESS_EQUAL) : {
+    binary_op(value_make_bool, <=);
+    dispatch();
+  }
+
+  vm_case(OP_POP) : {
+    sp--;
+    dispatch();
+  }
+
+  vm_case(OP_CLOSE) : {
+    close_upvalue(vm, sp);
+    sp--;
+    dispatch();
+  }
+
+  vm_case(OP_GLOBAL) : {
+    vm->globals.values.value[read_int16()] = pop();
+    dispatch();
+  }
+
+  vm_case(OP_SET_GLOBAL) : {
+    int slot = read_int16();
+    if (is_undef(vm->globals.values.value[slot])) {
+      runtime_error("Undefined variable '%s'.", global_name(vm, slot));
     }
+    vm->globals.values.value[slot] = peek(0);
+    dispatch();
   }
-}
 
-void vm_error(VM *vm, char *errmsg)
-{
-  vm->error = 1;
-  sprintf(vm->errmsg, "%s", errmsg);
-}
+  vm_case(OP_GET_GLOBAL) : {
+    int slot = read_int16();
+    Value value = vm->globals.values.value[slot];
+    if (is_undef(value)) {
+      runtime_error("Undefined variable '%s'.", global_name(vm, slot));
+    }
+    push(value);
+    dispatch();
+  }
 
-static void trace_stack(VM *vm)
-{
-  int i;
-  for (i = vm->cur_frame; i >= 0; i--) {
-    CallFrame *frame = &vm->frames[i];
-    fprintf(stderr, "[line %d] in %s",
-            frame->closure->proto->chunk.lines[frame->pc - 1],
-            frame->closure->proto->name->str);
-    if (i != 0) {
-      fprintf(stderr, "()");
+  vm_case(OP_SET_LOCAL) : {
+    bp[read_byte()] = peek(0);
+    dispatch();
+  }
+
+  vm_case(OP_GET_LOCAL) : {
+    push(bp[read_byte()]);
+    dispatch();
+  }
+
+  vm_case(OP_SET_UPVALUE) : {
+    uint8_t idx = read_byte();
+    ObjectUpValue *upvalue = frame->closure->upvalues[idx];
+    *upvalue->location = peek(0);
+    write_barrier((Object *)upvalue, peek(0));
+    dispatch();
+  }
+
+  vm_case(OP_GET_UPVALUE) : {
+    uint8_t idx = read_byte();
+    push(*frame->closure->upvalues[idx]->location);
+    dispatch();
+  }
+
+  vm_case(OP_JMP) : {
+    int offset = read_int16();
+    ip += offset;
+    dispatch();
+  }
+
+  vm_case(OP_JMP_BACK) : {
+    int offset = read_int16();
+    ip -= offset;
+    dispatch();
+  }
+
+  // OP_JMP_ON_FALSE does not pop the value
+  vm_case(OP_JMP_ON_FALSE) : {
+    int offset = read_int16();
+    if (!value_truable(peek(0))) {
+      ip += offset;
     }
-    fprintf(stderr, "\n");
+    dispatch();
   }
-}
 
-void vm_errorf(VM *vm, char *format, ...)
-{
-  vm->error = 1;
-  va_list ap;
-  va_start(ap, format);
-  int printed = vsprintf(vm->errmsg, format, ap);
-  fprintf(stderr, "%s\n", vm->errmsg);
-  trace_stack(vm);
-}
+  vm_case(OP_CALL) : {
+    uint8_t arity = read_byte();
+    Value callee = peek(arity);
+    if (is_closure(callee)) {
+      call_frame(call_fun(vm, arity, as_closure(callee)));
+    } else {
+      slow_path(call_value(vm, arity, callee));
+    }
+    dispatch();
+  }
 
-// fetch_code fetch and return the next code from vm chunk.
-uint8_t fetch_code(VM *vm)
-{
-  if (cur_frame(vm)->pc >= cur_chunk(vm)->len) {
-    panic("VM error: fetch_code overflow");
+  vm_case(OP_CLOSURE) : {
+    slow_path(op_closure(vm));
+    dispatch();
   }
-  uint8_t code = cur_chunk(vm)->code[cur_frame(vm)->pc];
-  cur_frame(vm)->pc++;
-  return code;
-}
 
-Value fetch_constant(VM *vm)
-{
-  uint8_t off = fetch_code(vm);
-  return vm->constants.value[off];
-}
+  vm_case(OP_CLASS) : {
+    slow_path(op_class(vm));
+    dispatch();
+  }
 
-int fetch_int16(VM *vm)
-{
-  int h8 = fetch_code(vm); // high 8 bit
-  int l8 = fetch_code(vm); // low  8 bit
-  return (h8 << 8) | l8;
-}
+  vm_case(OP_GET_FIELD) : {
+    Value field = read_constant_long();
+    InlineCache *ic = &ics[read_int16()];
+    if (!is_instance(peek(0))) {
+      runtime_error("Only instances have properties.");
+    }
+    ObjectInstance *ins = as_instance(peek(0));
+    ICEntry *entry = ic_find(ic, ins->shape);
+    if (entry != NULL && entry->slot >= 0) {
+      *sp = *instance_field(ins, entry->slot);
+    } else {
+      slow_path(get_property(vm, field, ic));
+    }
+    dispatch();
+  }
 
-void run_instruction(VM *vm, uint8_t i)
-{
-  switch (i) {
-  case OP_CONSTANT:
-    return op_constant(vm);
-  case OP_NEGATIVE:
-    return op_negative(vm);
-  case OP_NOT:
-    return op_not(vm);
+  vm_case(OP_SET_FIELD) : {
+    Value field = read_constant_long();
+    InlineCache *ic = &ics[read_int16()];
+    Value value = peek(0);
+    if (!is_instance(peek(1))) {
+      runtime_error("Only instances have fields.");
+    }
+    ObjectInstance *ins = as_instance(peek(1));
+    ICEntry *entry = ic_find(ic, ins->shape);
+    if (entry == NULL) {
+      set_property(ins, field, value, ic);
+    } else if (entry->next == NULL) {
+      *instance_field(ins, entry->slot) = value;
+      write_barrier((Object *)ins, value);
+    } else {
+      instance_add(ins, entry->next, value);
+    }
+    sp--;
+    *sp = value;
+    dispatch();
+  }
 
-  case OP_ADD:
-  case OP_MINUS:
-  case OP_MUL:
-  case OP_DIV:
-  case OP_BANG:
-  case OP_BANG_EQUAL:
-  case OP_EQUAL:
-  case OP_EQUAL_EQUAL:
-  case OP_GREATER:
-  case OP_GREATER_EQUAL:
-  case OP_LESS:
-  case OP_LESS_EQUAL:
-    return op_binary(vm, i);
+  vm_case(OP_METHOD) : {
+    slow_path(op_method(vm));
+    dispatch();
+  }
 
-  case OP_POP:
-    vm_pop(vm);
-    return;
-  case OP_CLOSE:
-    close_upvalue(vm, vm->sp);
-    vm_pop(vm);
-    return;
+  vm_case(OP_INVOKE) : {
+    uint8_t arity = read_byte();
+    int selector = read_int16();
+    InlineCache *ic = &ics[read_int16()];
+    if (!is_instance(peek(arity))) {
+      runtime_error("Only instances have methods.");
+    }
+    ObjectInstance *ins = as_instance(peek(arity));
+    ICEntry *entry = ic_find(ic, ins->shape);
+    if (entry == NULL) {
+      call_frame(invoke(vm, selector, arity, ic));
+    } else if (entry->slot < 0) {
+      // the shape has no field that could shadow the method
+      call_frame(call_fun(vm, arity, as_closure(entry->method)));
+    } else {
+      Value callee = *instance_field(ins, entry->slot);
+      peek(arity) = callee;
+      slow_path(call_value(vm, arity, callee));
+    }
+    dispatch();
+  }
 
-  case OP_GLOBAL:
-    return op_global(vm);
-
-  case OP_SET_GLOBAL:
-    return op_set_global(vm);
-  case OP_GET_GLOBAL:
-    return op_get_global(vm);
-
-  case OP_SET_LOCAL:
-    return op_set_local(vm);
-  case OP_GET_LOCAL:
-    return op_get_local(vm);
-
-  case OP_SET_UPVALUE:
-    return op_set_upvalue(vm);
-  case OP_GET_UPVALUE:
-    return op_get_upvalue(vm);
-
-  case OP_JMP:
-    return op_jmp(vm);
-  case OP_JMP_BACK:
-    return op_jmp_back(vm);
-  case OP_JMP_ON_FALSE:
-    return op_jmp_on_false(vm);
-
-  case OP_CALL:
-    return op_call(vm);
-  case OP_CLOSURE:
-    return op_closure(vm);
-  case OP_CLASS:
-    return op_class(vm);
-  case OP_GET_FIELD:
-    return op_get_filed(vm);
-  case OP_SET_FIELD:
-    return op_set_filed(vm);
-  case OP_METHOD:
-    return op_method(vm);
-  case OP_INVOKE:
-    return op_invoke(vm);
-  case OP_DERIVE:
-    return op_derive(vm);
-  case OP_GET_SUPER:
-    return op_get_super(vm);
-
-  case OP_RETURN:
-    return op_return(vm);
-
-  case OP_PRINT:
-    return op_print(vm);
-  }
-  // TODO: panic on unknown code
-  vm_error(vm, "unknown code");
-}
-
-void op_constant(VM *vm) { vm_push(vm, fetch_constant(vm)); }
-
-void op_negative(VM *vm)
-{
-  Value value = vm_pop(vm);
-  if (value.type != VT_NUM) {
-    vm_errorf(vm, "Operand must be a number.");
-    return;
+  vm_case(OP_DERIVE) : {
+    slow_path(op_derive(vm));
+    dispatch();
   }
-  double number = as_number(value);
-  vm_push(vm, value_make_number(-number));
-}
 
-void op_not(VM *vm)
-{
-  Value value = vm_pop(vm);
-  bool res = !value_truable(value);
-  vm_push(vm, value_make_bool(res));
-}
+  vm_case(OP_GET_SUPER) : {
+    slow_path(op_get_super(vm));
+    dispatch();
+  }
 
-Value concatenate(Value v1, Value v2)
-{
-  ObjectString *s1, *s2;
-  s1 = as_string(v1);
-  s2 = as_string(v2);
-  return value_make_object(string_concat(s1, s2));
-}
+  vm_case(OP_END_CLASS) : {
+    slow_path(op_end_class(vm));
+    dispatch();
+  }
 
-void op_binary(VM *vm, uint8_t op)
-{
-  Value v2 = vm_pop(vm);
-  Value v1 = vm_pop(vm);
+  vm_case(OP_GET_LOCAL_GET_FIELD) : {
+    Value object = bp[read_byte()];
+    Value field = read_constant_long();
+    InlineCache *ic = &ics[read_int16()];
+    if (!is_instance(object)) {
+      runtime_error("Only instances have properties.");
+    }
+    ObjectInstance *ins = as_instance(object);
+    ICEntry *entry = ic_find(ic, ins->shape);
+    if (entry != NULL && entry->slot >= 0) {
+      push(*instance_field(ins, entry->slot));
+    } else {
+      push(object);
+      slow_path(get_property(vm, field, ic));
+    }
+    dispatch();
+  }
 
-  Value v;
-  int error = 0;
+  vm_case(OP_ADD_CONST) : {
+    Value v2 = read_constant();
+    Value v1 = peek(0);
+    if (is_number(v1) && is_number(v2)) {
+      *sp = value_make_number(as_number(v1) + as_number(v2));
+    } else if (is_string(v1) && is_string(v2)) {
+      push(v2);
+      slow_path(op_concat(vm));
+    } else {
+      runtime_error("Operands must be two numbers or two strings.");
+    }
+    dispatch();
+  }
 
-#define op_calculation(op)                                                     \
-  if (is_number(v1) && is_number(v2))                                          \
-    v = value_make_number(as_number(v1) op as_number(v2));                     \
-  else                                                                         \
-    vm_errorf(vm, "Operands must be numbers.")
+  vm_case(OP_SET_LOCAL_POP) : {
+    bp[read_byte()] = pop();
+    dispatch();
+  }
 
-#define op_comparison(op)                                                      \
-  if (is_number(v1) && is_number(v2))                                          \
-    v = value_make_bool(as_number(v1) op as_number(v2));                       \
-  else                                                                         \
-    vm_errorf(vm, "Operands must be numbers.")
+  vm_case(OP_JMP_UNLESS_EQUAL) : {
+    Value v2 = pop();
+    Value v1 = pop();
+    int offset = read_int16();
+    if (!value_equal(v1, v2)) {
+      ip += offset;
+    }
+    dispatch();
+  }
 
-  switch (op) {
-  // calculation
-  case OP_ADD:
-    if (is_number(v1) && is_number(v2))
-      v = value_make_number(as_number(v1) + as_number(v2));
-    else if (is_string(v1) && is_string(v2))
-      v = concatenate(v1, v2);
-    else
-      vm_errorf(vm, "Operands must be two numbers or two strings.");
-    break;
+  vm_case(OP_JMP_UNLESS_GREATER) : {
+    compare_jmp(>);
+    dispatch();
+  }
 
-  case OP_MINUS:
-    op_calculation(-);
-    break;
+  vm_case(OP_JMP_UNLESS_GREATER_EQUAL) : {
+    compare_jmp(>=);
+    dispatch();
+  }
 
-  case OP_MUL:
-    op_calculation(*);
-    break;
+  vm_case(OP_JMP_UNLESS_LESS) : {
+    compare_jmp(<);
+    dispatch();
+  }
 
-  case OP_DIV:
-    op_calculation(/);
-    break;
+  vm_case(OP_JMP_UNLESS_LESS_EQUAL) : {
+    compare_jmp(<=);
+    dispatch();
+  }
 
-  // comparision '!=' '==' work on all value
-  case OP_BANG_EQUAL:
-    v = value_make_bool(!value_equal(v1, v2));
-    break;
+  vm_case(OP_ADD_LL) : {
+    register_add(read_local(), 0);
+    dispatch();
+  }
 
-  case OP_EQUAL_EQUAL:
-    v = value_make_bool(value_equal(v1, v2));
-    break;
+  vm_case(OP_ADD_LC) : {
+    register_add(read_constant(), 0);
+    dispatch();
+  }
 
-  // comparision on numbers
-  case OP_GREATER:
-    op_comparison(>);
-    break;
+  vm_case(OP_ADD_LL_TO) : {
+    register_add(read_local(), 1);
+    dispatch();
+  }
 
-  case OP_GREATER_EQUAL:
-    op_comparison(>=);
-    break;
+  vm_case(OP_ADD_LC_TO) : {
+    register_add(read_constant(), 1);
+    dispatch();
+  }
 
-  case OP_LESS:
-    op_comparison(<);
-    break;
+  vm_case(OP_MINUS_LL) : {
+    register_arith(-, read_local(), 0);
+    dispatch();
+  }
 
-  case OP_LESS_EQUAL:
-    op_comparison(<=);
-    break;
+  vm_case(OP_MINUS_LC) : {
+    register_arith(-, read_constant(), 0);
+    dispatch();
   }
 
-  if (error)
-    // TODO: make error msg clear
-    vm_error(vm, "type error");
-  else
-    vm_push(vm, v);
+  vm_case(OP_MINUS_LL_TO) : {
+    register_arith(-, read_local(), 1);
+    dispatch();
+  }
 
-#undef BINARY_OP_CAL
-#undef BINARY_OP_COMP
-}
+  vm_case(OP_MINUS_LC_TO) : {
+    register_arith(-, read_constant(), 1);
+    dispatch();
+  }
 
-static Map *globals(VM *vm) { return &vm->globals; }
+  vm_case(OP_MUL_LL) : {
+    register_arith(*, read_local(), 0);
+    dispatch();
+  }
 
-void op_global(VM *vm)
-{
-  Value name = fetch_constant(vm);
-  Value value = vm_pop(vm);
-  if (!is_string(name)) {
-    panic("programming error: OP_GLOBAL operates on a non-ident name");
+  vm_case(OP_MUL_LC) : {
+    register_arith(*, read_constant(), 0);
+    dispatch();
   }
-  map_put(globals(vm), name, value);
-}
 
-void op_set_global(VM *vm)
-{
-  Value name = fetch_constant(vm);
-  Value value = vm_pop(vm);
+  vm_case(OP_MUL_LL_TO) : {
+    register_arith(*, read_local(), 1);
+    dispatch();
+  }
 
-  if (!map_get(globals(vm), name, NULL)) {
-    vm_errorf(vm, "Undefined variable '%s'.", as_string(name)->str);
-    return;
+  vm_case(OP_MUL_LC_TO) : {
+    register_arith(*, read_constant(), 1);
+    dispatch();
   }
 
-  map_put(globals(vm), name, value);
-  vm_push(vm, value);
-}
+  vm_case(OP_DIV_LL) : {
+    register_arith(/, read_local(), 0);
+    dispatch();
+  }
 
-void op_get_global(VM *vm)
-{
-  Value name = fetch_constant(vm);
-  Value value;
+  vm_case(OP_DIV_LC) : {
+    register_arith(/, read_constant(), 0);
+    dispatch();
+  }
+
+  vm_case(OP_DIV_LL_TO) : {
+    register_arith(/, read_local(), 1);
+    dispatch();
+  }
+
+  vm_case(OP_DIV_LC_TO) : {
+    register_arith(/, read_constant(), 1);
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_EQUAL_LL) : {
+    Value v1 = read_local();
+    Value v2 = read_local();
+    int offset = read_int16();
+    if (!value_equal(v1, v2)) {
+      ip += offset;
+    }
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_EQUAL_LC) : {
+    Value v1 = read_local();
+    Value v2 = read_constant();
+    int offset = read_int16();
+    if (!value_equal(v1, v2)) {
+      ip += offset;
+    }
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_GREATER_LL) : {
+    register_compare_jmp(>, read_local());
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_GREATER_LC) : {
+    register_compare_jmp(>, read_constant());
+    dispatch();
+  }
 
-  if (!map_get(globals(vm), name, &value)) {
-    vm_errorf(vm, "Undefined variable '%s'.", as_string(name)->str);
+  vm_case(OP_JMP_UNLESS_GREATER_EQUAL_LL) : {
+    register_compare_jmp(>=, read_local());
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_GREATER_EQUAL_LC) : {
+    register_compare_jmp(>=, read_constant());
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_LESS_LL) : {
+    register_compare_jmp(<, read_local());
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_LESS_LC) : {
+    register_compare_jmp(<, read_constant());
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_LESS_EQUAL_LL) : {
+    register_compare_jmp(<=, read_local());
+    dispatch();
+  }
+
+  vm_case(OP_JMP_UNLESS_LESS_EQUAL_LC) : {
+    register_compare_jmp(<=, read_constant());
+    dispatch();
+  }
+
+  vm_case(OP_MOVE) : {
+    Value *dst = &read_local();
+    *dst = read_local();
+    dispatch();
+  }
+
+  vm_case(OP_LOAD_CONST) : {
+    Value *dst = &read_local();
+    *dst = read_constant();
+    dispatch();
+  }
+
+  vm_case(OP_RETURN) : {
+    Value retval = pop();
+    sp = bp;
+    close_upvalue(vm, sp);
+    sp--;
+    vm->cur_frame--;
+    if (vm->cur_frame < 0) {
+      vm->sp = sp;
+      vm->done = 1;
+      return;
+    }
+    push(retval);
+    vm->sp = sp;
+    load_state();
+    dispatch();
+  }
+
+  vm_case(OP_PRINT) : {
+    value_print(pop());
+    printf("\n");
+    dispatch();
+  }
+
+  vm_default : {
+    save_state();
+    // TODO: panic on unknown code
+    vm_error(vm, "unknown code");
     return;
   }
-  vm_push(vm, value);
+  }
+
+#undef save_state
+#undef load_state
+#undef load_chunk_end
+#undef read_byte
+#undef read_int16
+#undef read_constant
+#undef read_constant_long
+#undef push
+#undef pop
+#undef peek
+#undef runtime_error
+#undef call_frame
+#undef slow_path
+#undef binary_op
+#undef compare_jmp
+#undef debug_hook
+#undef vm_case
+#undef vm_default
+#undef dispatch
 }
 
-void op_set_local(VM *vm)
+void vm_error(VM *vm, char *errmsg)
 {
-  uint8_t off = fetch_code(vm);
-  Value *plocal = cur_frame(vm)->bp + off;
-  *plocal = vm_top(vm);
+  vm->error = 1;
+  sprintf(vm->errmsg, "%s", errmsg);
 }
 
-void op_get_local(VM *vm)
+static void trace_stack(VM *vm)
 {
-  uint8_t off = fetch_code(vm);
-  Value *plocal = &cur_frame(vm)->bp[off];
-  vm_push(vm, *plocal);
+  int i;
+  for (i = vm->cur_frame; i >= 0; i--) {
+    CallFrame *frame = &vm->frames[i];
+    fprintf(stderr, "[line %d] in %s",
+            chunk_line(&frame->closure->proto->chunk, frame->pc - 1),
+            frame->closure->proto->name->str);
+    if (i != 0) {
+      fprintf(stderr, "()");
+    }
+    fprintf(stderr, "\n");
+  }
 }
 
-void op_set_upvalue(VM *vm)
+void vm_errorf(VM *vm, char *format, ...)
 {
-  uint8_t idx = fetch_code(vm);
-  Value *location = cur_frame(vm)->closure->upvalues[idx]->location;
-  *location = vm_top(vm);
+  vm->error = 1;
+  va_list ap;
+  va_start(ap, format);
+  int printed = vsprintf(vm->errmsg, format, ap);
+  fprintf(stderr, "%s\n", vm->errmsg);
+  trace_stack(vm);
 }
 
-void op_get_upvalue(VM *vm)
+// fetch_code fetch and return the next code from vm chunk.
+uint8_t fetch_code(VM *vm)
 {
-  uint8_t idx = fetch_code(vm);
-  Value *location = cur_frame(vm)->closure->upvalues[idx]->location;
-  vm_push(vm, *location);
+#ifdef CHECKED_FETCH
+  if (cur_frame(vm)->pc >= cur_chunk(vm)->len) {
+    panic("VM error: fetch_code overflow");
+  }
+#endif
+  uint8_t code = cur_chunk(vm)->code[cur_frame(vm)->pc];
+  cur_frame(vm)->pc++;
+  return code;
 }
 
-void op_jmp(VM *vm) { cur_frame(vm)->pc += fetch_int16(vm); }
+static int fetch_int16(VM *vm)
+{
+  int high = fetch_code(vm);
+  return (high << 8) | fetch_code(vm);
+}
 
-void op_jmp_back(VM *vm) { cur_frame(vm)->pc -= fetch_int16(vm); }
+Value fetch_constant(VM *vm)
+{
+  int idx = fetch_int16(vm);
+  return cur_frame(vm)->closure->proto->constants.value[idx];
+}
 
-// op_jmp_on_false does not pop the value
-void op_jmp_on_false(VM *vm)
+// op_concat replaces the two strings on top of the stack with their
+// concatenation.
+void op_concat(VM *vm)
 {
-  int offset = fetch_int16(vm);
-  if (!value_truable(vm_top(vm))) {
-    cur_frame(vm)->pc += offset;
-  }
+  ObjectString *s2 = as_string(vm_topn(vm, 0));
+  ObjectString *s1 = as_string(vm_topn(vm, 1));
+  Value result = value_make_object(string_concat(s1, s2));
+  vm->sp -= 2;
+  vm_push(vm, result);
 }
 
+
 static void call_fun(VM *vm, int arity, ObjectClosure *callee)
 {
   if (arity != callee->proto->arity) {
@@ -532,6 +1139,10 @@ static void call_fun(VM *vm, int arity, ObjectClosure *callee)
               arity);
     return;
   }
+  if (vm->cur_frame == FRAME_MAX - 1 || !frame_fits(vm, callee)) {
+    vm_errorf(vm, "Stack overflow.");
+    return;
+  }
   frame_push(vm, callee);
 }
 
@@ -546,32 +1157,28 @@ static void call_native(VM *vm, int arity, ObjectNative *native)
   vm_push(vm, value);
 }
 
-static inline Value get_init_const(VM *vm)
-{
-  return value_array_get(&vm->constants, 0);
-}
-
 static void call_bound_method(VM *vm, int arity, ObjectBoundMethod *bm)
 {
   call_fun(vm, arity, bm->method);
+  if (vm->error) {
+    return;
+  }
   *cur_frame(vm)->bp = value_make_object(bm->receiver);
 }
 
 static void call_initializer(VM *vm, int arity, ObjectClass *klass)
 {
+  // The instance takes the place of the class in the callee slot, which
+  // keeps both of them rooted: the class stays reachable from the instance.
   ObjectInstance *ins = instance_new(klass);
+  *(vm->sp - arity) = value_make_object(ins);
 
-  Value initializer_value;
-  if (map_get(&klass->methods, get_init_const(vm), &initializer_value)) {
-    ObjectClosure *initializer = (ObjectClosure *)as_object(initializer_value);
+  ObjectClosure *initializer = class_method(klass, SELECTOR_INIT);
+  if (initializer != NULL) {
     ObjectBoundMethod *bm = bound_method_new(initializer, ins);
     call_bound_method(vm, arity, bm);
-  } else {
-    if (arity > 0) {
-      vm_errorf(vm, "Expected 0 arguments but got %d.", arity);
-      return;
-    }
-    vm_push(vm, value_make_object(ins));
+  } else if (arity > 0) {
+    vm_errorf(vm, "Expected 0 arguments but got %d.", arity);
   }
 }
 
@@ -590,17 +1197,13 @@ static void call_value(VM *vm, int arity, Value value)
   }
 }
 
-void op_call(VM *vm)
-{
-  uint8_t arity = fetch_code(vm);
-  Value value = *(vm->sp - arity);
-  call_value(vm, arity, value);
-}
-
 void op_closure(VM *vm)
 {
   Value proto = fetch_constant(vm);
   ObjectClosure *closure = closure_new(as_function(proto));
+  // Push the closure first so it stays rooted while its upvalues are
+  // allocated.
+  vm_push(vm, value_make_object((Object *)closure));
   for (int i = 0; i < closure->upvalue_size; i++) {
     uint8_t idx = fetch_code(vm);
     uint8_t from_local = fetch_code(vm);
@@ -608,8 +1211,10 @@ void op_closure(VM *vm)
                           ? cur_frame(vm)->bp + idx
                           : cur_frame(vm)->closure->upvalues[idx]->location;
     closure->upvalues[i] = open_upvalue(vm, location);
+    // Capturing may have collected and promoted the closure.
+    write_barrier((Object *)closure,
+                  value_make_object((Object *)closure->upvalues[i]));
   }
-  vm_push(vm, value_make_object((Object *)closure));
 }
 
 void op_class(VM *vm)
@@ -619,73 +1224,92 @@ void op_class(VM *vm)
   vm_push(vm, value_make_object(klass));
 }
 
-void op_get_filed(VM *vm)
+// find_method looks up the method of the instance's class for selector,
+// through ic.
+static bool find_method(ObjectInstance *ins, int selector, InlineCache *ic,
+                        Value *method)
 {
-  Value field = fetch_constant(vm);
-  Value vins = vm_pop(vm);
-  if (!is_instance(vins)) {
-    vm_errorf(vm, "Only instances have properties.");
-    return;
+  ICEntry *entry = ic_find(ic, ins->shape);
+  if (entry != NULL && entry->slot < 0) {
+    *method = entry->method;
+    return true;
   }
-
-  ObjectInstance *ins = as_instance(vins);
-  Value value;
-  if (map_get(&ins->fields, field, &value)) {
-    vm_push(vm, value);
-  } else if (map_get(&ins->klass->methods, field, &value)) {
-    ObjectClosure *method = (ObjectClosure *)as_object(value);
-    vm_push(vm, value_make_object(bound_method_new(method, ins)));
-  } else {
-    ObjectString *field_name = as_string(field);
-    vm_errorf(vm, "Undefined property '%s'.", field_name->str);
+  ObjectClosure *closure = class_method(ins->klass, selector);
+  if (closure == NULL) {
+    return false;
   }
+  *method = value_make_object((Object *)closure);
+  ic_update(ic, ins->shape, -1, NULL, *method);
+  return true;
 }
 
-void op_set_filed(VM *vm)
+// get_property replaces the instance on top of the stack with its property
+// name: the field if it has one, else its method bound to it.
+static void get_property(VM *vm, Value name, InlineCache *ic)
 {
-  Value field = fetch_constant(vm);
-  Value value = vm_pop(vm);
-  Value vins = vm_pop(vm);
-  if (!is_instance(vins)) {
-    vm_errorf(vm, "Only instances have fields.");
+  ObjectInstance *ins = as_instance(vm_top(vm));
+  Value value;
+  if (instance_get(ins, as_string(name), &value)) {
+    int slot = shape_find(ins->shape, as_string(name));
+    ic_update(ic, ins->shape, slot, NULL, value_make_nil());
+    vm_pop(vm);
+    vm_push(vm, value);
     return;
   }
-  ObjectInstance *ins = as_instance(vins);
-  map_put(&ins->fields, field, value);
-  vm_push(vm, value);
+  int selector = selector_find(as_string(name));
+  if (selector < 0 || !find_method(ins, selector, ic, &value)) {
+    vm_errorf(vm, "Undefined property '%s'.", as_string(name)->str);
+    return;
+  }
+  ObjectBoundMethod *bm = bound_method_new(as_closure(value), ins);
+  vm_pop(vm);
+  vm_push(vm, value_make_object((Object *)bm));
 }
 
-void op_method(VM *vm)
+// set_property sets field name of the instance, which never allocates
+// objects, and caches where the field went.
+static void set_property(ObjectInstance *ins, Value name, Value value,
+                         InlineCache *ic)
 {
-  Value name = fetch_constant(vm);
-  Value method = vm_pop(vm);
-  ObjectClass *klass = (ObjectClass *)as_object(vm_top(vm));
-  map_put(&klass->methods, name, method);
+  Shape *shape = ins->shape;
+  instance_set(ins, as_string(name), value);
+  if (ins->shape == shape) {
+    ic_update(ic, shape, shape_find(shape, as_string(name)), NULL,
+              value_make_nil());
+  } else if (!ins->shape->dictionary) {
+    ic_update(ic, shape, shape->size, ins->shape, value_make_nil());
+  }
 }
 
-void op_invoke(VM *vm)
+// invoke calls the property named by selector of the instance below the
+// arity arguments.
+static void invoke(VM *vm, int selector, int arity, InlineCache *ic)
 {
-  uint8_t arity = fetch_code(vm);
-  Value field = fetch_constant(vm);
-
-  ObjectInstance *ins = (ObjectInstance *)as_object(vm_topn(vm, arity));
-  ObjectClass *klass = ins->klass;
-
+  ObjectInstance *ins = as_instance(vm_topn(vm, arity));
+  ObjectString *name = selector_name(selector);
   Value method;
-
-  if (map_get(&ins->fields, field, &method)) {
-    *(vm->sp - arity) = method;
+  if (instance_get(ins, name, &method)) {
+    // a field shadows any method of the same name
+    int slot = shape_find(ins->shape, name);
+    ic_update(ic, ins->shape, slot, NULL, value_make_nil());
+    vm->sp[-arity] = method;
     call_value(vm, arity, method);
     return;
   }
-
-  if (!map_get(&klass->methods, field, &method)) {
-    vm_errorf(vm, "Undefined property '%s'.", as_string(field)->str);
+  if (!find_method(ins, selector, ic, &method)) {
+    vm_errorf(vm, "Undefined property '%s'.", name->str);
     return;
   }
   call_fun(vm, arity, as_closure(method));
 }
 
+void op_method(VM *vm)
+{
+  int selector = fetch_int16(vm);
+  ObjectClosure *method = as_closure(vm_pop(vm));
+  class_add_method(as_class(vm_top(vm)), selector, method);
+}
+
 void op_derive(VM *vm)
 {
   if (!is_class(vm_topn(vm, 1))) {
@@ -693,70 +1317,52 @@ void op_derive(VM *vm)
     return;
   }
 
-  ObjectClass *klass = as_class(vm_top(vm));
-  ObjectClass *super = as_class(vm_topn(vm, 1));
-
-  MapIter *iter = map_iter_new(&super->methods);
-  while (map_iter_next(iter)) {
-    map_put(&klass->methods, iter->key, iter->val);
-  }
-  map_iter_close(iter);
+  class_inherit(as_class(vm_top(vm)), as_class(vm_topn(vm, 1)));
 }
 
 void op_get_super(VM *vm)
 {
-  Value name = fetch_constant(vm);
+  int selector = fetch_int16(vm);
   ObjectClass *_super = as_class(vm_pop(vm));
-  ObjectInstance *ins = as_instance(vm_pop(vm));
+  ObjectInstance *ins = as_instance(vm_top(vm));
 
-  Value value;
-  if (!map_get(&_super->methods, name, &value)) {
-    vm_errorf(vm, "Undefined property '%s'.", as_string(name)->str);
+  ObjectClosure *method = class_method(_super, selector);
+  if (method == NULL) {
+    vm_errorf(vm, "Undefined property '%s'.", selector_name(selector)->str);
     return;
   }
 
-  ObjectBoundMethod *bm = bound_method_new(as_closure(value), ins);
+  ObjectBoundMethod *bm = bound_method_new(method, ins);
+  vm_pop(vm);
   vm_push(vm, value_make_object(bm));
 }
 
-void op_return(VM *vm)
+void op_end_class(VM *vm)
 {
-  Value retval = vm_pop(vm);
-  frame_pop(vm);
-  if (vm->cur_frame < 0) {
-    vm->done = 1;
-    return;
-  }
-  vm_push(vm, retval);
+  class_seal(as_class(vm_pop(vm)));
 }
 
-void op_print(VM *vm)
-{
-  Value value = vm_pop(vm);
-  if (vm->error) {
-    return;
-  }
-  value_print(value);
-  printf("\n");
-}
+// minor is set during a minor collection, which leaves old objects alone.
+static bool minor = false;
 
-static void mark_map(Map *map, ValueArray *wset)
+// mark_ics marks what the inline caches of function refer to. The classes
+// owning cached shapes are kept alive so that a new shape allocated at the
+// same address can never hit a stale entry.
+static void mark_ics(ObjectFunction *function, ValueArray *wset)
 {
-  MapIter *iter = map_iter_new(map);
-  while (map_iter_next(iter)) {
-    value_array_write(wset, iter->key);
-    value_array_write(wset, iter->val);
+  for (int i = 0; i < function->ic_size; i++) {
+    InlineCache *ic = &function->ics[i];
+    for (int j = 0; j < ic->len; j++) {
+      Object *klass = (Object *)ic->entries[j].shape->klass;
+      value_array_write(wset, value_make_object(klass));
+      value_array_write(wset, ic->entries[j].method);
+    }
   }
-  map_iter_close(iter);
 }
 
-static void mark_object(Object *obj, ValueArray *wset)
+// trace_object writes the objects referenced by obj into the work set.
+static void trace_object(Object *obj, ValueArray *wset)
 {
-  if (obj->marked) {
-    return;
-  }
-  obj->marked = true;
-
   switch (obj->type) {
 
   case OBJ_STRING:
@@ -765,6 +1371,10 @@ static void mark_object(Object *obj, ValueArray *wset)
   case OBJ_FUNCTION: {
     ObjectFunction *function = (ObjectFunction *)obj;
     value_array_write(wset, value_make_object(function->name));
+    for (int i = 0; i < function->constants.len; i++) {
+      value_array_write(wset, function->constants.value[i]);
+    }
+    mark_ics(function, wset);
   } break;
 
   case OBJ_UPVALUE: {
@@ -776,7 +1386,10 @@ static void mark_object(Object *obj, ValueArray *wset)
     ObjectClosure *closure = (ObjectClosure *)obj;
     value_array_write(wset, value_make_object(closure->proto));
     for (int i = 0; i < closure->upvalue_size; i++) {
-      value_array_write(wset, value_make_object(closure->upvalues[i]));
+      // upvalues are still NULL while the closure is being created
+      if (closure->upvalues[i] != NULL) {
+        value_array_write(wset, value_make_object(closure->upvalues[i]));
+      }
     }
   } break;
 
@@ -786,13 +1399,24 @@ static void mark_object(Object *obj, ValueArray *wset)
   case OBJ_CLASS: {
     ObjectClass *klass = (ObjectClass *)obj;
     value_array_write(wset, value_make_object(klass->name));
-    mark_map(&klass->methods, wset);
+    for (int i = 0; i < klass->method_size; i++) {
+      if (klass->methods[i] != NULL) {
+        value_array_write(wset, value_make_object((Object *)klass->methods[i]));
+      }
+    }
+    shape_mark(klass->shape, wset);
   } break;
 
   case OBJ_INSTANCE: {
     ObjectInstance *ins = (ObjectInstance *)obj;
     value_array_write(wset, value_make_object(ins->klass));
-    mark_map(&ins->fields, wset);
+    if (ins->shape->dictionary) {
+      map_trace(ins->dict, wset);
+    } else {
+      for (int i = 0; i < ins->shape->size; i++) {
+        value_array_write(wset, *instance_field(ins, i));
+      }
+    }
   } break;
 
   case OBJ_BOUND_METHOD: {
@@ -806,6 +1430,15 @@ static void mark_object(Object *obj, ValueArray *wset)
   }
 }
 
+static void mark_object(Object *obj, ValueArray *wset)
+{
+  if ((minor && obj->old) || slab_marked(obj)) {
+    return;
+  }
+  slab_mark(obj);
+  trace_object(obj, wset);
+}
+
 static void mark_value(Value value, ValueArray *wset)
 {
   if (!is_object(value)) {
@@ -816,11 +1449,19 @@ static void mark_value(Value value, ValueArray *wset)
 
 static void mark_root(VM *vm, ValueArray *wset)
 {
-  for (int i = 0; i < vm->constants.len; i++) {
-    value_array_write(wset, value_array_get(&vm->constants, i));
+  value_array_write(wset, vm->vmain);
+
+  for (int i = 0; i < vm->functions.len; i++) {
+    value_array_write(wset, vm->functions.value[i]);
   }
 
-  mark_map(&vm->globals, wset);
+  map_trace(&vm->globals.slots, wset);
+  for (int i = 0; i < selector_count(); i++) {
+    value_array_write(wset, value_make_object((Object *)selector_name(i)));
+  }
+  for (int i = 0; i < vm->globals.values.len; i++) {
+    value_array_write(wset, vm->globals.values.value[i]);
+  }
 
   for (Value *ss = vm->stack; ss <= vm->sp; ss++) {
     value_array_write(wset, *ss);
@@ -835,38 +1476,161 @@ static void mark_root(VM *vm, ValueArray *wset)
     value_array_write(wset, value_make_object(upvalue));
     upvalue = upvalue->next;
   }
+
+  // The inline caches are updated without a write barrier. A minor
+  // collection, which does not trace old objects, takes those of the old
+  // functions as roots, and a full one rescans them all once marking is done.
+  for (int i = 0; i < vm->functions.len; i++) {
+    Value value = vm->functions.value[i];
+    if (!minor || as_object(value)->old) {
+      mark_ics(as_function(value), wset);
+    }
+  }
+  if (!minor || as_object(vm->vmain)->old) {
+    mark_ics(as_function(vm->vmain), wset);
+  }
+
+  if (minor) {
+    // The other references old objects hold to young ones.
+    int len;
+    Object **remembered = heap_remembered(&len);
+    for (int i = 0; i < len; i++) {
+      trace_object(remembered[i], wset);
+    }
+  }
 }
 
-static void vm_gc(VM *vm)
+static uint64_t gc_now(void)
 {
-  ValueArray wset;
-  value_array_init(&wset);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// GC_STEP is how many objects are marked between two looks at the clock.
+#define GC_STEP 64
 
-  mark_root(vm, &wset);
+// GC_SWEEP_PAGES is how many pages a slice sweeps at most. The allocator
+// sweeps the pages of a size class before it needs a new one, and slices
+// sweep the rest, so that the collection ends.
+#define GC_SWEEP_PAGES 16
 
-  for (int i = 0; i < wset.len; i++) {
-    mark_value(value_array_get(&wset, i), &wset);
+// mark_step marks at most GC_STEP objects of the work set and returns
+// whether it is empty.
+static bool mark_step(ValueArray *wset)
+{
+  for (int i = 0; i < GC_STEP && wset->len > 0; i++) {
+    mark_value(wset->value[--wset->len], wset);
   }
+  return wset->len == 0;
+}
+
+// finish_marking rescans the roots, which are written without a barrier,
+// and marks what they reach in one go.
+static void finish_marking(VM *vm)
+{
+  ValueArray *wset = heap_gray();
+  mark_root(vm, wset);
+  while (!mark_step(wset))
+    ;
 
 #ifdef DEBUG_GC
   trace_heap();
 #endif
 
-  sweep_heap();
+  string_sweep();
+  heap_finish_marking();
+  vm->gc_stats.full++;
+}
+
+// gc_slice goes on with the full collection in progress: it marks until
+// marking is done or the deadline has passed, and otherwise sweeps a few
+// pages.
+static void gc_slice(VM *vm, uint64_t deadline)
+{
+  if (heap_marking) {
+    while (!mark_step(heap_gray())) {
+      if (gc_now() >= deadline) {
+        return;
+      }
+    }
+    finish_marking(vm);
+    return;
+  }
+  for (int i = 0; i < GC_SWEEP_PAGES && !heap_sweep(1); i++) {
+    if (gc_now() >= deadline) {
+      return;
+    }
+  }
+}
+
+// minor_gc collects the young generation.
+static void minor_gc(VM *vm)
+{
+  ValueArray *wset = heap_gray();
+  minor = true;
+  mark_root(vm, wset);
+  while (!mark_step(wset))
+    ;
+  minor = false;
 
 #ifdef DEBUG_GC
   trace_heap();
 #endif
 
-  value_array_free(&wset);
+  sweep_young();
+  vm->gc_stats.minor++;
 }
 
+// vm_gc runs a collection of the given kind. With gc_pause set, full
+// collections are incremental: each call marks as much as fits in the pause
+// target. Without it a full collection stops the program until marking is
+// done. The sweep is always spread over later allocations.
+static void vm_gc(VM *vm, gc_kind kind)
+{
+  uint64_t start = gc_now();
+  uint64_t deadline = vm->gc_pause ? start + vm->gc_pause : UINT64_MAX;
+
+  switch (kind) {
+  case GC_MINOR:
+    minor_gc(vm);
+    break;
+  case GC_FULL:
+    heap_start_marking();
+    mark_root(vm, heap_gray());
+    gc_slice(vm, deadline);
+    break;
+  case GC_SLICE:
+    gc_slice(vm, deadline);
+    break;
+  }
+
+  uint64_t pause = gc_now() - start;
+  vm->gc_stats.pauses++;
+  vm->gc_stats.total_pause += pause;
+  if (pause > vm->gc_stats.max_pause) {
+    vm->gc_stats.max_pause = pause;
+  }
+}
+
+// vm_gc_finish completes the full collection in progress, if any.
+static void vm_gc_finish(VM *vm)
+{
+  while (heap_marking || heap_sweeping()) {
+    gc_slice(vm, UINT64_MAX);
+  }
+}
+
+// vm_collect is the collector the vm registers with the heap while it runs.
+static void vm_collect(void *vm, gc_kind kind) { vm_gc((VM *)vm, kind); }
+
 static void vm_debug(VM *vm)
 {
   printf("======= DEBUG VM ======\n");
   printf("PC: %4d BP: %4ld NEXT OP: ", cur_frame(vm)->pc,
          (uint64_t)(cur_frame(vm)->bp - vm->stack));
-  debug_instruction(cur_chunk(vm), &vm->constants, cur_frame(vm)->pc);
+  debug_instruction(cur_chunk(vm), &cur_frame(vm)->closure->proto->constants,
+                    cur_frame(vm)->pc);
 
   printf("Call Frame\n");
   for (int i = vm->cur_frame; i >= 0; i--) {
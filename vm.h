@@ -2,7 +2,9 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "globals.h"
 #include "object.h"
+#include "profile.h"
 #include "value.h"
 
 typedef struct {
@@ -11,8 +13,19 @@ typedef struct {
   ObjectClosure *closure;
 } CallFrame;
 
-#define STACK_MAX 256
 #define FRAME_MAX 256
+// Every frame addresses at most UINT8_MAX + 1 slots.
+#define STACK_MAX (FRAME_MAX * (UINT8_MAX + 1))
+
+// GCStats counts the collections and how long they stopped the program, in
+// nanoseconds. A full collection may take several pauses.
+typedef struct {
+  uint64_t minor;
+  uint64_t full;
+  uint64_t pauses;
+  uint64_t total_pause;
+  uint64_t max_pause;
+} GCStats;
 
 typedef struct {
   int done;
@@ -23,8 +36,9 @@ typedef struct {
   ObjectFunction *main;
   ObjectClosure *main_closure;
 
-  Map globals;
-  ValueArray constants;
+  Globals globals;
+  // functions holds every function prototype compiled so far
+  ValueArray functions;
 
   Value stack[STACK_MAX];
   Value *sp; // Stack pointer
@@ -35,10 +49,25 @@ typedef struct {
   // open_upvalues maintain upvalues still in stack
   ObjectUpValue *open_upvalues;
 
-  // gc_threshold is the threshold for next gc.
-  unsigned int gc_threshold;
+  // profile collects opcode statistics if it is not NULL
+  Profile *profile;
+
+  // gc_pause is the pause target of full collections in nanoseconds. If it
+  // is 0 they are not incremental.
+  uint64_t gc_pause;
+  GCStats gc_stats;
 } VM;
 
+// NativeDef describes a native function, which vm_init binds to a global.
+typedef struct {
+  char *name;
+  int arity;
+  native_fn method;
+} NativeDef;
+
+extern const NativeDef vm_natives[];
+extern const int vm_native_count;
+
 void vm_init(VM *vm);
 void vm_run(VM *vm);
 void vm_push(VM *vm, Value v);